@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "user_function.h"
+#include "thread_pool.h"
+
+// Compiled formula that is first compiled at the cheapest optimisation level and counts its
+// calls. The call that reaches the threshold queues a recompile at libjit's maximum level on the
+// pool; calls go through libjit's redirector, so they move over to the optimised code on their
+// own once it is ready. Cold formulas compile fast, hot ones end up with the best code.
+class AdaptiveFunction {
+    WorkStealingPool &pool;
+    // kept for the recompile, which generates the function again
+    const FlatExpr program;
+    const size_t threshold;
+    PackedUserFunction function;
+    PackedUserFunction::native_t native;
+    std::atomic<size_t> calls{0};
+    std::atomic<bool> recompiling{false};
+    std::atomic<bool> optimized{false};
+
+    public:
+        AdaptiveFunction(WorkStealingPool &pool, jit_context &context, const FlatExpr &flat, size_t arity,
+                         size_t threshold = 10000):
+            pool{pool}, program{flat}, threshold{std::max<size_t>(threshold, 1)}, function(context, program, arity)
+        {
+            function.set_recompilable();
+            function.set_optimization_level(0);
+            function.compile_now();
+            native = function.native();
+        }
+
+        AdaptiveFunction(WorkStealingPool &pool, jit_context &context, const ExprAST &ast, const SymbolTable &symbols,
+                         size_t threshold = 10000):
+            AdaptiveFunction(pool, context, flatten(ast), symbols.size(), threshold) {}
+
+        AdaptiveFunction(const AdaptiveFunction&) = delete;
+        AdaptiveFunction &operator=(const AdaptiveFunction&) = delete;
+
+        // Waits for a recompile that is still queued or running
+        ~AdaptiveFunction()
+        {
+            while (recompiling) {
+                if (!pool.run_one()) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        // arguments[i] is the value of the identifier in slot i
+        jit_float64 operator()(const jit_float64 *arguments)
+        {
+            // counting stops at the threshold, hot calls only pay for the load
+            if (calls.load(std::memory_order_relaxed) < threshold &&
+                calls.fetch_add(1, std::memory_order_relaxed) + 1 == threshold) {
+                recompile();
+            }
+            return native(arguments);
+        }
+
+        jit_float64 operator()(const std::vector<jit_float64> &arguments)
+        {
+            return (*this)(arguments.data());
+        }
+
+        size_t call_count() const { return calls.load(std::memory_order_relaxed); }
+
+        bool is_optimized() const { return optimized; }
+
+        unsigned int optimization_level() const { return function.optimization_level(); }
+
+    private:
+        void recompile()
+        {
+            recompiling = true;
+            pool.submit([this] {
+                unsigned int level = function.optimization_level();
+                try {
+                    function.recompile(jit_function::max_optimization_level());
+                    optimized = true;
+                } catch (...) {
+                    // not retried, calls stay in the code compiled at the current level
+                    function.set_optimization_level(level);
+                }
+                recompiling = false;
+            });
+        }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <vector>
+#include <new>
+#include <string_view>
+
+#include "ast.h"
+
+// Bump allocator that owns every node of one or more expressions. Allocating a node is a pointer
+// bump, and destroying (or resetting) the arena releases all nodes at once without walking them.
+//
+// Parents built in the arena must only have arena children: a heap child below an arena parent
+// would never be deleted. Arena children below heap parents are fine.
+//
+// Every ExprPtr into the arena must be gone before the arena is destroyed or reset(): the
+// ExprDeleter reads node->arena_allocated, so a pointer that outlives the arena is a
+// use-after-free. Debug builds count the roots handed out by make() that are still alive, and
+// assert that there are none left when the memory is released.
+class ExprArena {
+    static constexpr size_t block_size = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cursor = nullptr;
+    char *end = nullptr;
+    size_t used = 0;
+#ifndef NDEBUG
+    // on the heap so that nodes keep pointing at it when the arena is moved
+    std::unique_ptr<size_t> live_roots;
+
+    // an arena child stops being a root when an arena parent takes it over
+    static void adopt(const ExprPtr &child)
+    {
+        if (child && child->arena_allocated) {
+            --*child->arena_roots;
+        }
+    }
+    static void adopt_children(const BinaryExprAST &node) { adopt(node.lhs); adopt(node.rhs); }
+    static void adopt_children(const UnaryExprAST &node) { adopt(node.arg); }
+    static void adopt_children(const ExprAST&) {}
+
+    void check_released() const
+    {
+        assert((!live_roots || *live_roots == 0) && "ExprPtr into the arena outlives its memory");
+    }
+#endif
+
+    void release()
+    {
+#ifndef NDEBUG
+        check_released();
+#endif
+        blocks.clear();
+        cursor = end = nullptr;
+        used = 0;
+    }
+
+    void *allocate(size_t size, size_t alignment)
+    {
+        auto aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(alignment - 1));
+        if (!cursor || aligned + size > end) {
+            blocks.emplace_back(new char[block_size]);
+            aligned = blocks.back().get();
+            end = aligned + block_size;
+        }
+        cursor = aligned + size;
+        used += size;
+        return aligned;
+    }
+
+    public:
+        ExprArena() = default;
+        ExprArena(const ExprArena&) = delete;
+        ExprArena &operator=(const ExprArena&) = delete;
+
+        // the moved-from arena is left empty, its next allocation starts a new block
+        ExprArena(ExprArena &&other) noexcept:
+            blocks{std::move(other.blocks)}, cursor{other.cursor}, end{other.end}, used{other.used}
+#ifndef NDEBUG
+            , live_roots{std::move(other.live_roots)}
+#endif
+        {
+            other.blocks.clear();
+            other.cursor = other.end = nullptr;
+            other.used = 0;
+        }
+
+        ExprArena &operator=(ExprArena &&other) noexcept
+        {
+            if (this != &other) {
+                release();
+                blocks = std::move(other.blocks);
+                cursor = other.cursor;
+                end = other.end;
+                used = other.used;
+#ifndef NDEBUG
+                live_roots = std::move(other.live_roots);
+#endif
+                other.blocks.clear();
+                other.cursor = other.end = nullptr;
+                other.used = 0;
+            }
+            return *this;
+        }
+
+        ~ExprArena()
+        {
+#ifndef NDEBUG
+            check_released();
+#endif
+        }
+
+        // Node destructors are not run, they have nothing to release besides arena children
+        template <typename Node, typename... Args>
+        ExprPtr make(Args&&... args)
+        {
+            static_assert(sizeof(Node) <= block_size, "node does not fit into an arena block");
+            Node *node = new (allocate(sizeof(Node), alignof(Node))) Node(std::forward<Args>(args)...);
+            node->arena_allocated = true;
+#ifndef NDEBUG
+            if (!live_roots) {
+                live_roots = std::make_unique<size_t>(0);
+            }
+            adopt_children(*node);
+            node->arena_roots = live_roots.get();
+            ++*live_roots;
+#endif
+            return ExprPtr(node);
+        }
+
+        ExprPtr number(jit_float64 value)
+        {
+            return make<NumberExprAST>(value);
+        }
+
+        ExprPtr identifier(SymbolTable &symbols, std::string_view identifier)
+        {
+            return make<IdentifierExprAST>(symbols.intern(identifier));
+        }
+
+        ExprPtr binary(BinaryOperator op, ExprPtr lhs, ExprPtr rhs)
+        {
+            return make<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+        }
+
+        ExprPtr unary(UnaryOperator op, ExprPtr arg)
+        {
+            return make<UnaryExprAST>(op, std::move(arg));
+        }
+
+        // bytes handed out to nodes so far
+        size_t bytes_used() const { return used; }
+
+        // Releases every node, expressions built in the arena must not be used afterwards
+        void reset()
+        {
+            release();
+        }
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+
+#include <jit/jit.h>
+
+// forward declaration for Visitor
+struct BinaryExprAST;
+struct UnaryExprAST;
+struct NumberExprAST;
+struct IdentifierExprAST;
+
+// visitor interface
+class Visitor {
+    public:
+        virtual void visit_binary_node(const BinaryExprAST *node) = 0;
+        virtual void visit_unary_node(const UnaryExprAST *node) = 0;
+        virtual void visit_number_node(const NumberExprAST *node) = 0;
+        virtual void visit_identifier_node(const IdentifierExprAST *node) = 0;
+};
+
+// AST nodes
+struct ExprAST {
+    virtual ~ExprAST() = default;
+    virtual void accept(Visitor *visitor) const = 0;
+
+    // set for nodes placed in an ExprArena, those are released together with the arena
+    bool arena_allocated = false;
+#ifndef NDEBUG
+    // live-root counter of the owning arena, see ExprArena
+    size_t *arena_roots = nullptr;
+#endif
+};
+
+// Deleter for child pointers: heap nodes are deleted, arena nodes are left to their arena
+struct ExprDeleter {
+    ExprDeleter() = default;
+    template <typename T>
+    ExprDeleter(const std::default_delete<T>&) {}
+
+    void operator()(ExprAST *node) const
+    {
+        if (!node->arena_allocated) {
+            delete node;
+        }
+#ifndef NDEBUG
+        else {
+            --*node->arena_roots;
+        }
+#endif
+    }
+};
+
+using ExprPtr = std::unique_ptr<ExprAST, ExprDeleter>;
+
+// AST node for raw values, only double is supported
+struct NumberExprAST: public ExprAST {
+    const jit_float64 value;
+
+    explicit NumberExprAST(jit_float64 value): value{value} {}
+    void accept(Visitor *visitor) const override { visitor->visit_number_node(this); }
+};
+
+// Interns identifier names into dense slot IDs. The slot of an identifier is also its
+// position in the generated function's parameter list (or argument block).
+class SymbolTable {
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> slots;
+
+    public:
+        SymbolTable() = default;
+        SymbolTable(std::initializer_list<std::string_view> identifiers)
+        {
+            for (auto identifier: identifiers) {
+                intern(identifier);
+            }
+        }
+
+        SymbolTable(const SymbolTable&) = delete;
+        SymbolTable &operator=(const SymbolTable&) = delete;
+
+        uint32_t intern(std::string_view identifier)
+        {
+            auto it = slots.find(identifier);
+            if (it != slots.end()) {
+                return it->second;
+            }
+            uint32_t slot = names.size();
+            // deque keeps the stored strings in place, so the views used as keys stay valid
+            slots.emplace(names.emplace_back(identifier), slot);
+            return slot;
+        }
+
+        const std::string &name(uint32_t slot) const { return names[slot]; }
+        size_t size() const { return names.size(); }
+};
+
+// AST node for identifier, already resolved to its slot in the SymbolTable
+struct IdentifierExprAST: public ExprAST {
+    const uint32_t slot;
+    explicit IdentifierExprAST(uint32_t slot): slot{slot} {}
+    void accept(Visitor *visitor) const override { visitor->visit_identifier_node(this); }
+};
+
+enum class BinaryOperator {
+    Plus,
+    Minus,
+    Mult,
+    Div,
+    // constant exponents are expanded into multiplications and roots, see power.h
+    Pow,
+};
+
+// number of BinaryOperators, for tables indexed by the operator: has to name the last one
+constexpr size_t binary_operator_count = static_cast<size_t>(BinaryOperator::Pow) + 1;
+
+// AST node that represents binary operations listed in BinaryOperator enum
+struct BinaryExprAST: public ExprAST {
+    const BinaryOperator op;
+    const ExprPtr lhs, rhs;
+    BinaryExprAST(BinaryOperator op, ExprPtr lhs, ExprPtr rhs):
+        op{op}, lhs{std::move(lhs)}, rhs{std::move(rhs)} {}
+    void accept(Visitor *visit) const override { visit->visit_binary_node(this); }
+};
+
+enum class UnaryOperator {
+    Acos,
+    Asin,
+    Atan,
+    Cos,
+    Cosh,
+    Exp,
+    Log10,
+    Sin,
+    Sinh,
+    Sqrt,
+    Tan,
+    Tanh,
+};
+
+// number of UnaryOperators, for tables indexed by the operator: has to name the last one
+constexpr size_t unary_operator_count = static_cast<size_t>(UnaryOperator::Tanh) + 1;
+
+// AST node that represents unary operations listed in UnaryOperator enum
+struct UnaryExprAST: public ExprAST {
+    UnaryOperator op;
+    ExprPtr arg;
+
+    UnaryExprAST(UnaryOperator op, ExprPtr arg):
+        op{op}, arg{std::move(arg)} {}
+    void accept(Visitor *visit) const override { visit->visit_unary_node(this); }
+};
+
+//
+// Helper functions to make this look more concise, one could also use operator overload
+//
+
+inline std::unique_ptr<NumberExprAST> Number(double val)
+{
+    return std::make_unique<NumberExprAST>(static_cast<jit_float64>(val));
+}
+
+inline std::unique_ptr<IdentifierExprAST> Identifier(SymbolTable &symbols, std::string_view identifier) {
+    return std::make_unique<IdentifierExprAST>(symbols.intern(identifier));
+}
+
+inline std::unique_ptr<BinaryExprAST> Mult(ExprPtr lhs, ExprPtr rhs)
+{
+    return std::make_unique<BinaryExprAST>(BinaryOperator::Mult, std::move(lhs), std::move(rhs));
+}
+
+inline std::unique_ptr<BinaryExprAST> Add(ExprPtr lhs, ExprPtr rhs)
+{
+    return std::make_unique<BinaryExprAST>(BinaryOperator::Plus, std::move(lhs), std::move(rhs));
+}
+
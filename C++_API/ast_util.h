@@ -0,0 +1,230 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include "ast.h"
+#include "power.h"
+
+// Evaluates a single operator on numbers, matching what the generated code computes
+inline jit_float64 evaluate(BinaryOperator op, jit_float64 lhs, jit_float64 rhs)
+{
+    switch(op) {
+        case BinaryOperator::Plus:
+            return lhs + rhs;
+        case BinaryOperator::Minus:
+            return lhs - rhs;
+        case BinaryOperator::Mult:
+            return lhs * rhs;
+        case BinaryOperator::Div:
+            return lhs / rhs;
+        case BinaryOperator::Pow:
+            return power(lhs, rhs);
+    }
+    return NAN;
+}
+
+inline jit_float64 evaluate(UnaryOperator op, jit_float64 arg)
+{
+    switch(op) {
+        case UnaryOperator::Acos:
+            return std::acos(arg);
+        case UnaryOperator::Asin:
+            return std::asin(arg);
+        case UnaryOperator::Atan:
+            return std::atan(arg);
+        case UnaryOperator::Cos:
+            return std::cos(arg);
+        case UnaryOperator::Cosh:
+            return std::cosh(arg);
+        case UnaryOperator::Exp:
+            return std::exp(arg);
+        case UnaryOperator::Log10:
+            return std::log10(arg);
+        case UnaryOperator::Sin:
+            return std::sin(arg);
+        case UnaryOperator::Sinh:
+            return std::sinh(arg);
+        case UnaryOperator::Sqrt:
+            return std::sqrt(arg);
+        case UnaryOperator::Tan:
+            return std::tan(arg);
+        case UnaryOperator::Tanh:
+            return std::tanh(arg);
+    }
+    return NAN;
+}
+
+// Structural (Merkle) hash of an ExprAST: every node hashes its own kind and payload
+// together with the hashes of its children, so equal trees hash equal no matter where
+// they are allocated. Identifiers hash by slot, which is what the generated code depends on.
+class ExprHasher: public Visitor {
+    uint64_t current_hash;
+    size_t nodes = 0;
+
+    static uint64_t mix(uint64_t h, uint64_t v)
+    {
+        // boost::hash_combine widened to 64 bits
+        return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 12) + (h >> 4));
+    }
+
+    public:
+        uint64_t hash(const ExprAST &ast)
+        {
+            ast.accept(this);
+            return current_hash;
+        }
+
+        // number of nodes visited by all hash() calls so far
+        size_t node_count() const { return nodes; }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            node->lhs->accept(this);
+            uint64_t lhs = current_hash;
+            node->rhs->accept(this);
+            uint64_t rhs = current_hash;
+            current_hash = mix(mix(mix(1, static_cast<uint64_t>(node->op)), lhs), rhs);
+            nodes++;
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            node->arg->accept(this);
+            current_hash = mix(mix(2, static_cast<uint64_t>(node->op)), current_hash);
+            nodes++;
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &node->value, sizeof(bits));
+            current_hash = mix(3, bits);
+            nodes++;
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_hash = mix(4, node->slot);
+            nodes++;
+        }
+};
+
+// Deep copy of an ExprAST
+class ExprCloner: public Visitor {
+    std::unique_ptr<ExprAST> current_result;
+    size_t nodes = 0;
+
+    public:
+        std::unique_ptr<ExprAST> clone(const ExprAST &ast)
+        {
+            nodes++;
+            ast.accept(this);
+            return std::move(current_result);
+        }
+
+        // nodes created by every clone() call so far
+        size_t node_count() const { return nodes; }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            auto lhs = clone(*node->lhs);
+            auto rhs = clone(*node->rhs);
+            current_result = std::make_unique<BinaryExprAST>(node->op, std::move(lhs), std::move(rhs));
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            current_result = std::make_unique<UnaryExprAST>(node->op, clone(*node->arg));
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = std::make_unique<NumberExprAST>(node->value);
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = std::make_unique<IdentifierExprAST>(node->slot);
+        }
+};
+
+// Structural equality, numbers compare bitwise so that 0.0 and -0.0 stay distinct
+class ExprEquals: public Visitor {
+    const ExprAST *other;
+    bool result;
+
+    public:
+        bool equals(const ExprAST &lhs, const ExprAST &rhs)
+        {
+            other = &rhs;
+            lhs.accept(this);
+            return result;
+        }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            auto rhs = dynamic_cast<const BinaryExprAST*>(other);
+            result = rhs && rhs->op == node->op &&
+                equals(*node->lhs, *rhs->lhs) && equals(*node->rhs, *rhs->rhs);
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            auto rhs = dynamic_cast<const UnaryExprAST*>(other);
+            result = rhs && rhs->op == node->op && equals(*node->arg, *rhs->arg);
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            auto rhs = dynamic_cast<const NumberExprAST*>(other);
+            result = rhs && std::memcmp(&rhs->value, &node->value, sizeof(node->value)) == 0;
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            auto rhs = dynamic_cast<const IdentifierExprAST*>(other);
+            result = rhs && rhs->slot == node->slot;
+        }
+};
+
+// Tree-walking evaluator, arguments[i] is the value of the identifier in slot i. This is the
+// reference the faster evaluators are checked and measured against.
+class ExprEvaluator: public Visitor {
+    const jit_float64 *arguments;
+    jit_float64 current_result;
+
+    public:
+        jit_float64 evaluate(const ExprAST &ast, const jit_float64 *arguments)
+        {
+            this->arguments = arguments;
+            ast.accept(this);
+            return current_result;
+        }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            node->lhs->accept(this);
+            jit_float64 lhs = current_result;
+            node->rhs->accept(this);
+            current_result = ::evaluate(node->op, lhs, current_result);
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            node->arg->accept(this);
+            current_result = ::evaluate(node->op, current_result);
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = node->value;
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = arguments[node->slot];
+        }
+};
@@ -0,0 +1,85 @@
+// Build and teardown throughput of heap allocated (unique_ptr) trees versus ExprArena trees
+#include <cstdio>
+#include <chrono>
+#include <vector>
+
+#include "ast.h"
+#include "arena.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// complete binary tree of alternating Add/Mult nodes over numbers and identifiers
+static ExprPtr build_heap(SymbolTable &symbols, int depth, uint32_t &counter)
+{
+    if (depth == 0) {
+        if (counter++ % 2) {
+            return Number(counter);
+        }
+        return ExprPtr(std::make_unique<IdentifierExprAST>(counter % symbols.size()));
+    }
+    auto lhs = build_heap(symbols, depth - 1, counter);
+    auto rhs = build_heap(symbols, depth - 1, counter);
+    if (depth % 2) {
+        return Add(std::move(lhs), std::move(rhs));
+    }
+    return Mult(std::move(lhs), std::move(rhs));
+}
+
+static ExprPtr build_arena(ExprArena &arena, SymbolTable &symbols, int depth, uint32_t &counter)
+{
+    if (depth == 0) {
+        if (counter++ % 2) {
+            return arena.number(counter);
+        }
+        return arena.make<IdentifierExprAST>(counter % symbols.size());
+    }
+    auto lhs = build_arena(arena, symbols, depth - 1, counter);
+    auto rhs = build_arena(arena, symbols, depth - 1, counter);
+    return arena.binary(depth % 2 ? BinaryOperator::Plus : BinaryOperator::Mult, std::move(lhs), std::move(rhs));
+}
+
+int main()
+{
+    const int depth = 12;
+    const int trees = 512;
+    const int repetitions = 5;
+    const double nodes = double((1 << (depth + 1)) - 1) * trees;
+
+    SymbolTable symbols({"a", "b", "c", "d", "e", "f", "g", "h"});
+    double heap_build = 0, heap_teardown = 0, arena_build = 0, arena_teardown = 0;
+
+    for (int r = 0; r < repetitions; r++) {
+        uint32_t counter = 0;
+        std::vector<ExprPtr> roots;
+        auto start = bench_clock::now();
+        for (int t = 0; t < trees; t++) {
+            roots.push_back(build_heap(symbols, depth, counter));
+        }
+        heap_build += seconds_since(start);
+        start = bench_clock::now();
+        roots.clear();
+        heap_teardown += seconds_since(start);
+
+        counter = 0;
+        auto arena = std::make_unique<ExprArena>();
+        start = bench_clock::now();
+        for (int t = 0; t < trees; t++) {
+            roots.push_back(build_arena(*arena, symbols, depth, counter));
+        }
+        arena_build += seconds_since(start);
+        start = bench_clock::now();
+        roots.clear();
+        arena.reset();
+        arena_teardown += seconds_since(start);
+    }
+
+    double total = nodes * repetitions;
+    printf("%-10s %15s %18s\n", "", "build Mnodes/s", "teardown Mnodes/s");
+    printf("%-10s %15.1f %18.1f\n", "unique_ptr", total / heap_build / 1e6, total / heap_teardown / 1e6);
+    printf("%-10s %15.1f %18.1f\n", "arena", total / arena_build / 1e6, total / arena_teardown / 1e6);
+}
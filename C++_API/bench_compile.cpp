@@ -0,0 +1,93 @@
+// Compile throughput of 10k formulas on an increasing number of threads, all threads sharing one
+// jit_context versus one context per thread from a ContextPool
+#include <cstdio>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "parser.h"
+#include "user_function.h"
+#include "context_pool.h"
+#include "bench_corpus.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Runs compile_one(i) for every formula on `threads` threads pulling from a shared counter
+template <typename F>
+static double run_threads(unsigned threads, size_t count, F compile_one)
+{
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i = next++; i < count; i = next++) {
+            compile_one(i);
+        }
+    };
+    auto start = bench_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned id = 1; id < threads; id++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread: pool) {
+        thread.join();
+    }
+    return seconds_since(start);
+}
+
+int main()
+{
+    const size_t count = 10000;
+
+    SymbolTable symbols;
+    std::vector<ExprPtr> formulas;
+    std::mt19937 rng(42);
+    for (size_t i = 0; i < count; i++) {
+        std::string text;
+        generate_formula(text, rng, 6);
+        formulas.push_back(parse(text, symbols));
+    }
+
+    unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    printf("%8s %16s %16s\n", "threads", "shared ctx/s", "ctx pool/s");
+    for (unsigned threads: thread_counts) {
+        double shared_seconds;
+        {
+            jit_context context;
+            std::vector<std::unique_ptr<UserFunction>> functions(count);
+            shared_seconds = run_threads(threads, count, [&](size_t i) {
+                functions[i] = std::make_unique<UserFunction>(context, *formulas[i], symbols);
+                functions[i]->compile_now();
+            });
+        }
+
+        double pool_seconds;
+        {
+            ContextPool contexts;
+            std::vector<std::unique_ptr<UserFunction>> functions(count);
+            pool_seconds = run_threads(threads, count, [&](size_t i) {
+                functions[i] = contexts.compile(*formulas[i], symbols);
+            });
+        }
+
+        printf("%8u %16.0f %16.0f\n", threads, count / shared_seconds, count / pool_seconds);
+    }
+}
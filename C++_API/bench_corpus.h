@@ -0,0 +1,52 @@
+#pragma once
+
+#include <random>
+#include <string>
+
+// Random formula generator shared by the benchmarks, produces text the Parser accepts
+inline void generate_formula(std::string &out, std::mt19937 &rng, int depth)
+{
+    static const char *functions[] = {"sin", "cos", "exp", "sqrt", "tanh", "log10"};
+    static const char operators[] = {'+', '-', '*', '/'};
+    std::uniform_int_distribution<int> pick(0, 9);
+
+    if (depth == 0 || pick(rng) < 2) {
+        if (pick(rng) < 5) {
+            out += "x" + std::to_string(pick(rng) * 7 + pick(rng));
+        } else {
+            out += std::to_string(pick(rng) + pick(rng) / 10.0).substr(0, 4);
+        }
+        return;
+    }
+    switch (pick(rng) % 3) {
+        case 0:
+            out += functions[pick(rng) % 6];
+            out += '(';
+            generate_formula(out, rng, depth - 1);
+            out += ')';
+            break;
+        case 1:
+            out += '(';
+            generate_formula(out, rng, depth - 1);
+            out += ')';
+            break;
+        default:
+            generate_formula(out, rng, depth - 1);
+            out += ' ';
+            out += operators[pick(rng) % 4];
+            out += ' ';
+            generate_formula(out, rng, depth - 1);
+    }
+}
+
+// Newline separated corpus of at least `bytes` bytes
+inline std::string generate_corpus(size_t bytes, int depth = 8, unsigned seed = 42)
+{
+    std::mt19937 rng(seed);
+    std::string corpus;
+    while (corpus.size() < bytes) {
+        generate_formula(corpus, rng, depth);
+        corpus += '\n';
+    }
+    return corpus;
+}
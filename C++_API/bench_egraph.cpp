@@ -0,0 +1,88 @@
+// E-graph optimiser on the benchmark corpus: per rewrite mode, the speed-up the cost model
+// estimates against the speed-up measured by timing the libjit compiled formulas before and after
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "egraph.h"
+#include "parser.h"
+#include "rewrite.h"
+#include "user_function.h"
+#include "bench_corpus.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const size_t count = 500;
+    const int calls = 20000;
+
+    SymbolTable symbols;
+    std::vector<ExprPtr> trees;
+    std::mt19937 rng(42);
+    for (size_t i = 0; i < count; i++) {
+        std::string text;
+        generate_formula(text, rng, 8);
+        trees.push_back(parse(text, symbols));
+    }
+    std::vector<jit_float64> arguments(symbols.size(), 0.5);
+
+    double sink = 0;
+    // seconds for `calls` evaluations of every tree
+    auto measure = [&](const std::vector<ExprPtr> &expressions) {
+        jit_context context;
+        std::vector<std::unique_ptr<PackedUserFunction>> functions;
+        for (auto &expression: expressions) {
+            functions.push_back(std::make_unique<PackedUserFunction>(context, flatten(*expression), symbols.size()));
+            functions.back()->compile_now();
+        }
+        auto start = bench_clock::now();
+        for (auto &function: functions) {
+            auto native = function->native();
+            for (int i = 0; i < calls; i++) {
+                sink += native(arguments.data());
+            }
+        }
+        return seconds_since(start);
+    };
+    double baseline = measure(trees);
+
+    auto rules = egraph_rules();
+    printf("%-10s %10s %10s %12s %12s %10s\n", "mode", "saturated", "ms/formula", "nodes", "estimated", "measured");
+    for (RewriteMode mode: {RewriteMode::BitExact, RewriteMode::FastMath}) {
+        EGraphOptimizer optimizer(rules, mode);
+        std::vector<ExprPtr> optimized;
+        size_t saturated = 0;
+        size_t nodes = 0;
+        double seconds = 0;
+        jit_float64 cost_before = 0;
+        jit_float64 cost_after = 0;
+        for (auto &tree: trees) {
+            optimized.push_back(optimizer.optimize(*tree));
+            auto &report = optimizer.report();
+            saturated += report.saturated;
+            nodes += report.nodes;
+            seconds += report.seconds;
+            cost_before += report.cost_before;
+            cost_after += report.cost_after;
+        }
+        printf("%-10s %9zu%% %10.2f %12zu %11.2fx %9.2fx\n", mode == RewriteMode::BitExact ? "bit-exact" : "fast-math",
+               saturated * 100 / count, seconds / count * 1e3, nodes / count, cost_before / cost_after,
+               baseline / measure(optimized));
+    }
+    if (sink == 42) {
+        printf("\n");
+    }
+}
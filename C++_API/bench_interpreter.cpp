@@ -0,0 +1,94 @@
+// Interpreters against each other, and the bytecode interpreter against libjit compiled code:
+// evaluations per second, and the total cost of lowering/compiling plus `calls` evaluations
+// per formula, which shows after how many calls compiling pays off
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "ast_util.h"
+#include "flat.h"
+#include "bytecode.h"
+#include "parser.h"
+#include "user_function.h"
+#include "bench_corpus.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const size_t count = 1000;
+    const int repetitions = 100;
+
+    SymbolTable symbols;
+    std::vector<ExprPtr> trees;
+    std::vector<FlatExpr> flats;
+    std::mt19937 rng(42);
+    for (size_t i = 0; i < count; i++) {
+        std::string text;
+        generate_formula(text, rng, 8);
+        trees.push_back(parse(text, symbols));
+        flats.push_back(flatten(*trees.back()));
+    }
+    std::vector<jit_float64> arguments(symbols.size(), 0.5);
+    std::vector<Bytecode> programs;
+    for (auto &flat: flats) {
+        programs.emplace_back(flat);
+    }
+
+    double sink = 0;
+    auto report = [&](const char *name, auto evaluate_one) {
+        auto start = bench_clock::now();
+        for (int r = 0; r < repetitions; r++) {
+            for (size_t i = 0; i < count; i++) {
+                sink += evaluate_one(i);
+            }
+        }
+        printf("%-12s %10.2f M evaluations/s\n", name, count * repetitions / seconds_since(start) * 1e-6);
+    };
+    ExprEvaluator tree_walker;
+    report("tree walk", [&](size_t i) { return tree_walker.evaluate(*trees[i], arguments.data()); });
+    report("flat switch", [&](size_t i) { return evaluate(flats[i], arguments.data()); });
+    report("bytecode", [&](size_t i) { return programs[i](arguments.data()); });
+
+    printf("\n%8s %16s %16s\n", "calls", "bytecode us", "libjit us");
+    for (size_t calls: {1, 10, 100, 1000, 10000, 100000}) {
+        auto start = bench_clock::now();
+        for (auto &flat: flats) {
+            Bytecode program(flat);
+            for (size_t i = 0; i < calls; i++) {
+                sink += program(arguments.data());
+            }
+        }
+        double interpreted = seconds_since(start);
+
+        start = bench_clock::now();
+        {
+            jit_context context;
+            for (auto &flat: flats) {
+                PackedUserFunction function(context, flat, symbols.size());
+                function.compile_now();
+                auto native = function.native();
+                for (size_t i = 0; i < calls; i++) {
+                    sink += native(arguments.data());
+                }
+            }
+        }
+        double compiled = seconds_since(start);
+
+        printf("%8zu %16.2f %16.2f\n", calls, interpreted / count * 1e6, compiled / count * 1e6);
+    }
+    if (sink == 42) {
+        printf("\n");
+    }
+}
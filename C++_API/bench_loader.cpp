@@ -0,0 +1,41 @@
+// Cold-start loading of a formula file with an increasing number of parser threads
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "loader.h"
+#include "bench_corpus.h"
+
+int main(int argc, char **argv)
+{
+    std::string path = argc > 1 ? argv[1] : "bench_loader_corpus.txt";
+    if (argc <= 1) {
+        std::ofstream(path, std::ios::binary) << generate_corpus(64u << 20);
+    }
+
+    // powers of two up to the number of cores, and the number of cores itself
+    unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < max_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    printf("%8s %10s %10s %10s %10s %12s\n", "threads", "read s", "split s", "parse s", "merge s", "formulas");
+    for (unsigned threads: thread_counts) {
+        FormulaSet set;
+        if (!load_formula_file(set, path, threads)) {
+            fprintf(stderr, "cannot read %s\n", path.c_str());
+            return 1;
+        }
+        printf("%8u %10.3f %10.3f %10.3f %10.3f %12zu\n", threads, set.timing.read, set.timing.split,
+               set.timing.parse, set.timing.merge, set.formulas.size());
+    }
+
+    if (argc <= 1) {
+        std::remove(path.c_str());
+    }
+}
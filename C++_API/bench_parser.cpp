@@ -0,0 +1,83 @@
+// Parser throughput in MB/s over a generated corpus of newline separated formulas
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <string_view>
+
+#include "ast.h"
+#include "arena.h"
+#include "flat.h"
+#include "parser.h"
+#include "bench_corpus.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// parses every line `repetitions` times, nodes is the number of nodes in the whole corpus
+template <typename Parse>
+static void run(const char *name, const std::vector<std::string_view> &lines, size_t bytes, size_t nodes, Parse parse)
+{
+    const int repetitions = 5;
+    auto start = bench_clock::now();
+    for (int r = 0; r < repetitions; r++) {
+        for (auto line: lines) {
+            parse(line);
+        }
+    }
+    double seconds = seconds_since(start);
+    printf("%-8s %8.1f MB/s %8.1f Mnodes/s\n", name, bytes * repetitions / seconds / 1e6,
+           nodes * repetitions / seconds / 1e6);
+}
+
+int main()
+{
+    std::string corpus = generate_corpus(32u << 20);
+
+    std::vector<std::string_view> lines;
+    std::string_view rest(corpus);
+    while (!rest.empty()) {
+        size_t end = rest.find('\n');
+        lines.push_back(rest.substr(0, end));
+        rest.remove_prefix(end + 1);
+    }
+    printf("corpus: %zu formulas, %.1f MB\n", lines.size(), corpus.size() / 1e6);
+
+    SymbolTable symbols;
+    FlatExpr flat;
+    FlatBuilder flat_builder{flat};
+    Parser<FlatBuilder> flat_parser(flat_builder, symbols);
+
+    size_t nodes = 0;
+    for (auto line: lines) {
+        flat.nodes.clear();
+        flat_parser.parse(line);
+        nodes += flat.nodes.size();
+    }
+
+    run("flat", lines, corpus.size(), nodes, [&](std::string_view line) {
+        flat.nodes.clear();
+        flat.root = flat_parser.parse(line);
+    });
+
+    ExprArena arena;
+    ArenaBuilder arena_builder{arena};
+    Parser<ArenaBuilder> arena_parser(arena_builder, symbols);
+    run("arena", lines, corpus.size(), nodes, [&](std::string_view line) {
+        arena_parser.parse(line);
+        // recycle the arena now and then, like a loader that hands off batches of formulas
+        if (arena.bytes_used() > (64u << 20)) {
+            arena.reset();
+        }
+    });
+
+    HeapBuilder heap_builder;
+    Parser<HeapBuilder> heap_parser(heap_builder, symbols);
+    run("heap", lines, corpus.size(), nodes, [&](std::string_view line) {
+        heap_parser.parse(line);
+    });
+}
@@ -0,0 +1,64 @@
+// Polynomials of degree 13 written three ways: powers as repeated Mult, as ^ with integer
+// exponents (expanded into addition chains), and as ^ with exponents just off the integers,
+// which cannot be expanded and go to libm pow. Prints the time per call of the compiled code.
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "parser.h"
+#include "user_function.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const int degree = 13;
+    const int calls = 1000000;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> coefficient(-2, 2);
+    std::string repeated_mult, integer_pow, libm_pow;
+    for (int k = 1; k <= degree; k++) {
+        std::string c = std::to_string(coefficient(rng));
+        repeated_mult += " + " + c;
+        for (int i = 0; i < k; i++) {
+            repeated_mult += "*x";
+        }
+        integer_pow += " + " + c + "*x^" + std::to_string(k);
+        libm_pow += " + " + c + "*x^" + std::to_string(k) + ".000000001";
+    }
+
+    SymbolTable symbols;
+    jit_context context;
+    double sink = 0;
+    printf("%-14s %10s\n", "form", "ns/call");
+    for (auto &form: {std::make_pair("repeated Mult", repeated_mult), std::make_pair("integer ^", integer_pow),
+                      std::make_pair("libm pow", libm_pow)}) {
+        auto tree = parse("0" + form.second, symbols);
+        PackedUserFunction function(context, flatten(*tree), symbols.size());
+        function.compile_now();
+        auto native = function.native();
+        jit_float64 x = 0.5;
+        auto start = bench_clock::now();
+        for (int i = 0; i < calls; i++) {
+            sink += native(&x);
+            x += 1e-9;
+        }
+        printf("%-14s %10.2f\n", form.first, seconds_since(start) / calls * 1e9);
+    }
+    if (sink == 42) {
+        printf("\n");
+    }
+}
@@ -0,0 +1,63 @@
+// Latency of 64-term sums and products, as the parser builds them (left-deep chains) and after
+// reassociation into balanced trees. Every call's argument depends on the previous result, so
+// calls do not overlap and the time per call is the length of the dependency chain.
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "parser.h"
+#include "reassociate.h"
+#include "user_function.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const size_t terms = 64;
+    const int calls = 1000000;
+
+    SymbolTable symbols;
+    std::string sum, product;
+    for (size_t i = 0; i < terms; i++) {
+        std::string name = "x" + std::to_string(i);
+        sum += (i ? " + " : "") + name;
+        product += (i ? " * " : "") + name;
+    }
+    auto sum_tree = parse(sum, symbols);
+    auto product_tree = parse(product, symbols);
+    std::vector<jit_float64> arguments(symbols.size());
+    for (size_t i = 0; i < arguments.size(); i++) {
+        arguments[i] = 1 + i * 1e-3;
+    }
+
+    jit_context context;
+    auto latency = [&](const ExprAST &ast) {
+        PackedUserFunction function(context, flatten(ast), symbols.size());
+        function.compile_now();
+        auto native = function.native();
+        std::vector<jit_float64> chained = arguments;
+        auto start = bench_clock::now();
+        for (int i = 0; i < calls; i++) {
+            // adds nothing to x0, but the next call has to wait for this one
+            chained[0] = arguments[0] + native(chained.data()) * 1e-300;
+        }
+        return seconds_since(start) / calls * 1e9;
+    };
+
+    printf("%-8s %14s %14s %10s\n", "chain", "left-deep ns", "balanced ns", "speed-up");
+    for (auto *tree: {sum_tree.get(), product_tree.get()}) {
+        double before = latency(*tree);
+        double after = latency(*reassociate(*tree));
+        printf("%-8s %14.2f %14.2f %9.2fx\n", tree == sum_tree.get() ? "sum" : "product", before, after, before / after);
+    }
+}
@@ -0,0 +1,65 @@
+// Time per call of code emitted in source order (every lhs before its rhs) and in register order
+// (the child with the larger Sethi-Ullman need first, the default).
+// In a right-leaning sum of products every lhs product stays live while the rest of the sum is
+// computed, so source order runs out of registers and spills; register order needs two. The
+// left-deep sum is what the parser produces, there both orders are the same.
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "parser.h"
+#include "user_function.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const size_t terms = 32;
+    const int calls = 1000000;
+
+    SymbolTable symbols;
+    std::string right_leaning = "x0", left_deep;
+    for (size_t i = 1; i < terms; i++) {
+        std::string product = "x" + std::to_string(i) + "*y" + std::to_string(i);
+        right_leaning = product + " + (" + right_leaning + ")";
+        left_deep += (i > 1 ? " + " : "") + product;
+    }
+    auto right_tree = parse(right_leaning, symbols);
+    auto left_tree = parse(left_deep, symbols);
+    std::vector<jit_float64> arguments(symbols.size());
+    for (size_t i = 0; i < arguments.size(); i++) {
+        arguments[i] = 1 + i * 1e-3;
+    }
+
+    jit_context context;
+    auto time_per_call = [&](const ExprAST &tree, bool register_order) {
+        PackedUserFunction function(context, tree, symbols.size());
+        function.set_register_order(register_order);
+        function.compile_now();
+        auto native = function.native();
+        std::vector<jit_float64> chained = arguments;
+        auto start = bench_clock::now();
+        for (int i = 0; i < calls; i++) {
+            // calls do not overlap, the next one has to wait for this result
+            chained[0] = arguments[0] + native(chained.data()) * 1e-300;
+        }
+        return seconds_since(start) / calls * 1e9;
+    };
+
+    printf("%-14s %16s %18s\n", "shape", "source order ns", "register order ns");
+    for (auto *tree: {right_tree.get(), left_tree.get()}) {
+        double source = time_per_call(*tree, false);
+        double registers = time_per_call(*tree, true);
+        printf("%-14s %16.2f %18.2f\n", tree == right_tree.get() ? "right-leaning" : "left-deep", source, registers);
+    }
+}
@@ -0,0 +1,80 @@
+// Start-up cost of a formula library: registering formulas for on-demand compilation versus
+// constructing a UserFunction per formula and compiling it up front, and the total once a
+// fraction of the formulas is actually called
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "parser.h"
+#include "user_function.h"
+#include "library.h"
+#include "bench_corpus.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const size_t count = 10000;
+    // every called_every-th formula is called once after start-up
+    const size_t called_every = 10;
+
+    SymbolTable symbols;
+    std::vector<FlatExpr> formulas;
+    std::mt19937 rng(42);
+    for (size_t i = 0; i < count; i++) {
+        std::string text;
+        generate_formula(text, rng, 6);
+        formulas.push_back(parse_flat(text, symbols));
+    }
+    std::vector<jit_float64> arguments(symbols.size(), 0.5);
+    double sink = 0;
+
+    double eager_startup, eager_total;
+    {
+        auto start = bench_clock::now();
+        jit_context context;
+        std::vector<std::unique_ptr<UserFunction>> functions;
+        for (auto &formula: formulas) {
+            functions.push_back(std::make_unique<UserFunction>(context, formula, symbols.size()));
+            functions.back()->compile_now();
+        }
+        eager_startup = seconds_since(start);
+        for (size_t i = 0; i < count; i += called_every) {
+            sink += functions[i]->call(arguments);
+        }
+        eager_total = seconds_since(start);
+    }
+
+    double lazy_startup, lazy_total;
+    {
+        auto start = bench_clock::now();
+        FormulaLibrary library;
+        for (auto &formula: formulas) {
+            library.add(formula, symbols.size());
+        }
+        lazy_startup = seconds_since(start);
+        for (size_t i = 0; i < count; i += called_every) {
+            sink += library.call(i, arguments.data());
+        }
+        lazy_total = seconds_since(start);
+    }
+
+    printf("%-10s %20s %16s\n", "", "startup us/formula", "total s");
+    printf("%-10s %20.2f %16.3f\n", "eager", eager_startup / count * 1e6, eager_total);
+    printf("%-10s %20.2f %16.3f\n", "on demand", lazy_startup / count * 1e6, lazy_total);
+    if (sink == 42) {
+        printf("\n");
+    }
+}
@@ -0,0 +1,88 @@
+// Cold formulas called a few times: compiling every formula up front versus the tiered executor,
+// which interprets until a formula has been called `threshold` times
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "parser.h"
+#include "user_function.h"
+#include "tiered.h"
+#include "bench_corpus.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main()
+{
+    const size_t count = 1000;
+    const size_t threshold = 64;
+
+    SymbolTable symbols;
+    std::vector<FlatExpr> formulas;
+    std::mt19937 rng(42);
+    for (size_t i = 0; i < count; i++) {
+        std::string text;
+        generate_formula(text, rng, 6);
+        formulas.push_back(parse_flat(text, symbols));
+    }
+    std::vector<jit_float64> arguments(symbols.size(), 0.5);
+
+    WorkStealingPool pool;
+    printf("%8s %16s %16s %16s %16s\n", "calls", "eager first us", "tiered first us", "eager total s", "tiered total s");
+    for (size_t calls: {1, 10, 100, 1000, 10000}) {
+        double sink = 0;
+
+        double eager_first = 0;
+        auto start = bench_clock::now();
+        {
+            jit_context context;
+            for (auto &formula: formulas) {
+                auto first_start = bench_clock::now();
+                PackedUserFunction function(context, formula, symbols.size());
+                function.compile_now();
+                auto native = function.native();
+                sink += native(arguments.data());
+                eager_first += seconds_since(first_start);
+                for (size_t i = 1; i < calls; i++) {
+                    sink += native(arguments.data());
+                }
+            }
+        }
+        double eager_total = seconds_since(start);
+
+        double tiered_first = 0;
+        start = bench_clock::now();
+        {
+            TieredExecutor executor(pool, threshold);
+            std::vector<std::unique_ptr<TieredFunction>> functions;
+            for (auto &formula: formulas) {
+                auto first_start = bench_clock::now();
+                functions.push_back(executor.make(formula, symbols.size()));
+                TieredFunction &function = *functions.back();
+                sink += function(arguments.data());
+                tiered_first += seconds_since(first_start);
+                for (size_t i = 1; i < calls; i++) {
+                    sink += function(arguments.data());
+                }
+            }
+        }
+        double tiered_total = seconds_since(start);
+
+        printf("%8zu %16.2f %16.2f %16.3f %16.3f\n", calls, eager_first / count * 1e6, tiered_first / count * 1e6,
+               eager_total, tiered_total);
+        if (sink == 42) {
+            printf("\n");
+        }
+    }
+}
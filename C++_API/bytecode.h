@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "ast.h"
+#include "ast_util.h"
+#include "flat.h"
+#include "dag.h"
+#include "power.h"
+
+// Register machine the interpreter runs. Opcodes mirror BinaryOperator and UnaryOperator one to
+// one, Cbrt is only used by powers with a constant exponent, Return ends the program.
+enum class Opcode: uint8_t {
+    Plus,
+    Minus,
+    Mult,
+    Div,
+    Pow,
+    Acos,
+    Asin,
+    Atan,
+    Cos,
+    Cosh,
+    Exp,
+    Log10,
+    Sin,
+    Sinh,
+    Sqrt,
+    Tan,
+    Tanh,
+    Cbrt,
+    Return,
+};
+
+// dst = a op b on registers, Return: the result is register a
+struct Instruction {
+    Opcode opcode;
+    uint32_t dst;
+    uint32_t a;
+    uint32_t b;
+};
+
+static_assert(sizeof(Instruction) == 16, "Instruction is meant to fit four per cache line");
+
+// Expression lowered to linear register code. The expression is hash-consed first, so a repeated
+// subexpression is evaluated once. Constants and the arguments the expression reads are copied
+// into the first registers before the code runs, so only operators are dispatched, and temporary
+// registers are reused as soon as their value is dead.
+//
+// With GCC and Clang every handler jumps straight to the next one through a table of label
+// addresses (threaded code). Each handler then has its own indirect branch, which predicts much
+// better than the single shared one of a switch loop. Other compilers get the switch loop.
+class Bytecode {
+    std::vector<Instruction> code;
+    // registers [0, constants.size()) hold the constants, the next argument_slots.size()
+    // registers the arguments in those slots
+    std::vector<jit_float64> constants;
+    std::vector<uint32_t> argument_slots;
+    uint32_t register_count = 0;
+    // constant register holding 1, only there if a power needs it
+    uint32_t one_register = UINT32_MAX;
+
+    // register files up to this size live on the stack of operator()
+    static constexpr size_t stack_registers = 128;
+
+    static Opcode opcode(BinaryOperator op)
+    {
+        return static_cast<Opcode>(static_cast<int>(Opcode::Plus) + static_cast<int>(op));
+    }
+
+    static Opcode opcode(UnaryOperator op)
+    {
+        return static_cast<Opcode>(static_cast<int>(Opcode::Acos) + static_cast<int>(op));
+    }
+
+    static bool is_expanded_power(const FlatExpr &dag, const FlatNode &node, PowerPlan &plan)
+    {
+        return node.kind == FlatNode::Kind::Binary && node.binary_op() == BinaryOperator::Pow &&
+            dag.nodes[node.rhs].kind == FlatNode::Kind::Number && plan_power(dag.nodes[node.rhs].value, plan);
+    }
+
+    // Lowers base^exponent as planned into instructions on registers from the free list. Returns
+    // the register of the result, the ones it used on the way go back to the free list.
+    uint32_t lower_power(uint32_t base, const PowerPlan &plan, std::vector<uint32_t> &free_registers)
+    {
+        struct RegisterOps {
+            Bytecode &program;
+            std::vector<uint32_t> &free_registers;
+            std::vector<uint32_t> used;
+
+            uint32_t emit(Opcode opcode, uint32_t a, uint32_t b)
+            {
+                if (free_registers.empty()) {
+                    free_registers.push_back(program.register_count++);
+                }
+                uint32_t dst = free_registers.back();
+                free_registers.pop_back();
+                used.push_back(dst);
+                program.code.push_back({opcode, dst, a, b});
+                return dst;
+            }
+
+            uint32_t mult(uint32_t a, uint32_t b) { return emit(Opcode::Mult, a, b); }
+            uint32_t div(uint32_t a, uint32_t b) { return emit(Opcode::Div, a, b); }
+            uint32_t sqrt(uint32_t a) { return emit(Opcode::Sqrt, a, 0); }
+            uint32_t cbrt(uint32_t a) { return emit(Opcode::Cbrt, a, 0); }
+            uint32_t one() { return program.one_register; }
+        };
+
+        RegisterOps ops{*this, free_registers, {}};
+        uint32_t result = expand_power(ops, base, plan);
+        if (ops.used.empty()) {
+            // x^0 and x^1 emit nothing, the node still needs a register of its own
+            result = ops.mult(result, one_register);
+        }
+        // the result is computed last
+        ops.used.pop_back();
+        free_registers.insert(free_registers.end(), ops.used.begin(), ops.used.end());
+        return result;
+    }
+
+    void lower(const FlatExpr &dag)
+    {
+        constexpr uint32_t none = UINT32_MAX;
+        if (dag.nodes.empty()) {
+            constants.push_back(0);
+            code.push_back({Opcode::Return, 0, 0, 0});
+            register_count = 1;
+            return;
+        }
+
+        // index of the last node reading each node, the root stays live until Return
+        std::vector<uint32_t> last_use(dag.nodes.size(), 0);
+        for (uint32_t i = 0; i < dag.nodes.size(); i++) {
+            const FlatNode &node = dag.nodes[i];
+            if (node.kind == FlatNode::Kind::Unary || node.kind == FlatNode::Kind::Binary) {
+                last_use[node.lhs] = i;
+            }
+            if (node.kind == FlatNode::Kind::Binary) {
+                last_use[node.rhs] = i;
+            }
+        }
+        last_use[dag.root] = none;
+
+        // leaves get the fixed registers at the front
+        std::vector<uint32_t> registers(dag.nodes.size(), none);
+        for (uint32_t i = 0; i < dag.nodes.size(); i++) {
+            if (dag.nodes[i].kind == FlatNode::Kind::Number) {
+                registers[i] = constants.size();
+                constants.push_back(dag.nodes[i].value);
+            }
+        }
+        PowerPlan plan;
+        for (auto &node: dag.nodes) {
+            if (is_expanded_power(dag, node, plan)) {
+                one_register = constants.size();
+                constants.push_back(1);
+                break;
+            }
+        }
+        for (uint32_t i = 0; i < dag.nodes.size(); i++) {
+            if (dag.nodes[i].kind == FlatNode::Kind::Identifier) {
+                registers[i] = constants.size() + argument_slots.size();
+                argument_slots.push_back(dag.nodes[i].slot);
+            }
+        }
+        register_count = constants.size() + argument_slots.size();
+
+        std::vector<uint32_t> free_registers;
+        auto release = [&](uint32_t operand, uint32_t user) {
+            FlatNode::Kind kind = dag.nodes[operand].kind;
+            if (last_use[operand] == user && (kind == FlatNode::Kind::Unary || kind == FlatNode::Kind::Binary)) {
+                free_registers.push_back(registers[operand]);
+            }
+        };
+
+        for (uint32_t i = 0; i < dag.nodes.size(); i++) {
+            const FlatNode &node = dag.nodes[i];
+            if (i != dag.root && last_use[i] == 0) {
+                // leaf, or not reachable from the root
+                continue;
+            }
+            if (is_expanded_power(dag, node, plan)) {
+                // the base is read by every step, it is released once the power is done
+                registers[i] = lower_power(registers[node.lhs], plan, free_registers);
+                release(node.lhs, i);
+                continue;
+            }
+            Instruction instruction{Opcode::Return, 0, 0, 0};
+            if (node.kind == FlatNode::Kind::Unary) {
+                instruction = {opcode(node.unary_op()), 0, registers[node.lhs], 0};
+                release(node.lhs, i);
+            } else if (node.kind == FlatNode::Kind::Binary) {
+                instruction = {opcode(node.binary_op()), 0, registers[node.lhs], registers[node.rhs]};
+                release(node.lhs, i);
+                // x op x reads a single register, release it once
+                if (node.rhs != node.lhs) {
+                    release(node.rhs, i);
+                }
+            } else {
+                continue;
+            }
+            // operands are read before dst is written, so dst may reuse an operand's register
+            if (free_registers.empty()) {
+                free_registers.push_back(register_count++);
+            }
+            registers[i] = free_registers.back();
+            free_registers.pop_back();
+            instruction.dst = registers[i];
+            code.push_back(instruction);
+        }
+        code.push_back({Opcode::Return, 0, registers[dag.root], 0});
+    }
+
+    public:
+        explicit Bytecode(const FlatExpr &flat)
+        {
+            lower(flat.nodes.empty() ? flat : build_dag(flat));
+        }
+
+        explicit Bytecode(const ExprAST &ast)
+        {
+            lower(build_dag(ast));
+        }
+
+        size_t size() const { return code.size(); }
+        size_t registers() const { return register_count; }
+
+        // arguments[i] is the value of slot i, registers must hold registers() values
+        jit_float64 run(const jit_float64 *arguments, jit_float64 *registers) const
+        {
+            jit_float64 *r = registers;
+            std::copy(constants.begin(), constants.end(), r);
+            r += constants.size();
+            for (uint32_t slot: argument_slots) {
+                *r++ = arguments[slot];
+            }
+            r = registers;
+            const Instruction *pc = code.data();
+
+#if defined(__GNUC__)
+            // in Opcode order
+            static const void *const handlers[] = {
+                &&op_Plus, &&op_Minus, &&op_Mult, &&op_Div, &&op_Pow,
+                &&op_Acos, &&op_Asin, &&op_Atan, &&op_Cos, &&op_Cosh, &&op_Exp, &&op_Log10,
+                &&op_Sin, &&op_Sinh, &&op_Sqrt, &&op_Tan, &&op_Tanh, &&op_Cbrt, &&op_Return,
+            };
+            static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(Opcode::Return) + 1,
+                          "one handler per opcode");
+#define OP(name) op_##name
+#define NEXT goto *handlers[static_cast<size_t>((++pc)->opcode)]
+            goto *handlers[static_cast<size_t>(pc->opcode)];
+#else
+#define OP(name) case Opcode::name
+#define NEXT pc++; continue
+            for (;;) switch(pc->opcode) {
+#endif
+            OP(Plus): r[pc->dst] = r[pc->a] + r[pc->b]; NEXT;
+            OP(Minus): r[pc->dst] = r[pc->a] - r[pc->b]; NEXT;
+            OP(Mult): r[pc->dst] = r[pc->a] * r[pc->b]; NEXT;
+            OP(Div): r[pc->dst] = r[pc->a] / r[pc->b]; NEXT;
+            OP(Pow): r[pc->dst] = power(r[pc->a], r[pc->b]); NEXT;
+            OP(Acos): r[pc->dst] = std::acos(r[pc->a]); NEXT;
+            OP(Asin): r[pc->dst] = std::asin(r[pc->a]); NEXT;
+            OP(Atan): r[pc->dst] = std::atan(r[pc->a]); NEXT;
+            OP(Cos): r[pc->dst] = std::cos(r[pc->a]); NEXT;
+            OP(Cosh): r[pc->dst] = std::cosh(r[pc->a]); NEXT;
+            OP(Exp): r[pc->dst] = std::exp(r[pc->a]); NEXT;
+            OP(Log10): r[pc->dst] = std::log10(r[pc->a]); NEXT;
+            OP(Sin): r[pc->dst] = std::sin(r[pc->a]); NEXT;
+            OP(Sinh): r[pc->dst] = std::sinh(r[pc->a]); NEXT;
+            OP(Sqrt): r[pc->dst] = std::sqrt(r[pc->a]); NEXT;
+            OP(Tan): r[pc->dst] = std::tan(r[pc->a]); NEXT;
+            OP(Tanh): r[pc->dst] = std::tanh(r[pc->a]); NEXT;
+            OP(Cbrt): r[pc->dst] = std::cbrt(r[pc->a]); NEXT;
+            OP(Return): return r[pc->a];
+#if !defined(__GNUC__)
+            }
+#endif
+#undef OP
+#undef NEXT
+        }
+
+        // Runs with a register file on the stack, or kept per thread for very large expressions
+        jit_float64 operator()(const jit_float64 *arguments) const
+        {
+            if (register_count <= stack_registers) {
+                jit_float64 registers[stack_registers];
+                return run(arguments, registers);
+            }
+            static thread_local std::vector<jit_float64> registers;
+            if (registers.size() < register_count) {
+                registers.resize(register_count);
+            }
+            return run(arguments, registers.data());
+        }
+};
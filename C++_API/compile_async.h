@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ast.h"
+#include "flat.h"
+#include "compile_cache.h"
+#include "compile_service.h"
+#include "thread_pool.h"
+
+// Handle to a function that is compiled in the background. Copies share the same result.
+class CompileHandle {
+    public:
+        using Callback = std::function<void(const CompileHandle&)>;
+
+        // True once the compile finished, successfully or not, never blocks
+        bool ready() const
+        {
+            std::lock_guard<std::mutex> guard(state->lock);
+            return state->done;
+        }
+
+        void wait() const
+        {
+            std::unique_lock<std::mutex> lock(state->lock);
+            state->finished.wait(lock, [this] { return state->done; });
+        }
+
+        template <typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period> &timeout) const
+        {
+            std::unique_lock<std::mutex> lock(state->lock);
+            return state->finished.wait_for(lock, timeout, [this] { return state->done; });
+        }
+
+        // Waits for the compile and returns the function, or rethrows what the compile threw
+        std::shared_ptr<CachedFunction> get() const
+        {
+            wait();
+            if (state->error) {
+                std::rethrow_exception(state->error);
+            }
+            return state->function;
+        }
+
+        // Calls callback(*this) once the compile finished: right away on the calling thread if it
+        // already has, otherwise on the thread that compiled it. Keep callbacks short, they hold
+        // up that compile thread.
+        void then(Callback callback) const
+        {
+            {
+                std::lock_guard<std::mutex> guard(state->lock);
+                if (!state->done) {
+                    state->callbacks.push_back(std::move(callback));
+                    return;
+                }
+            }
+            callback(*this);
+        }
+
+    private:
+        struct State {
+            std::mutex lock;
+            std::condition_variable finished;
+            bool done = false;
+            std::shared_ptr<CachedFunction> function;
+            std::exception_ptr error;
+            std::vector<Callback> callbacks;
+        };
+
+        std::shared_ptr<State> state = std::make_shared<State>();
+
+        void complete(std::shared_ptr<CachedFunction> function, std::exception_ptr error) const
+        {
+            std::vector<Callback> callbacks;
+            {
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->function = std::move(function);
+                state->error = error;
+                state->done = true;
+                callbacks.swap(state->callbacks);
+            }
+            state->finished.notify_all();
+            for (auto &callback: callbacks) {
+                callback(*this);
+            }
+        }
+
+        friend class AsyncCompiler;
+};
+
+// Compiles expressions on a WorkStealingPool so request threads never wait for codegen.
+// Requests go through a CompileService, so an expression that is requested again while it is
+// compiling, or after, is not compiled a second time.
+class AsyncCompiler {
+    WorkStealingPool &pool;
+    CompileService service;
+    std::atomic<size_t> outstanding{0};
+
+    public:
+        explicit AsyncCompiler(WorkStealingPool &pool): pool{pool} {}
+
+        AsyncCompiler(const AsyncCompiler&) = delete;
+        AsyncCompiler &operator=(const AsyncCompiler&) = delete;
+
+        // The pool drops tasks that are still queued when it is destroyed, so finish them here
+        ~AsyncCompiler()
+        {
+            while (outstanding > 0) {
+                if (!pool.run_one()) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        CompileHandle compile_async(FlatExpr flat, size_t arity)
+        {
+            CompileHandle handle;
+            outstanding++;
+            pool.submit([this, handle, flat = std::move(flat), arity]() mutable {
+                std::shared_ptr<CachedFunction> function;
+                std::exception_ptr error;
+                try {
+                    function = service.get(std::move(flat), arity);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                handle.complete(std::move(function), error);
+                outstanding--;
+            });
+            return handle;
+        }
+
+        // The tree is flattened on the calling thread, it does not have to outlive the compile
+        CompileHandle compile_async(const ExprAST &ast, const SymbolTable &identifiers)
+        {
+            return compile_async(flatten(ast), identifiers.size());
+        }
+
+        CompileService::Stats stats() const { return service.stats(); }
+};
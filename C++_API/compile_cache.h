@@ -0,0 +1,183 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "dag.h"
+#include "user_function.h"
+
+// A compiled expression owned by the CompileCache. libjit only releases code when the whole
+// jit_context is destroyed, so entries share the context of their cache generation, and the
+// context goes away with the last entry of the generation that is still referenced. The entry
+// keeps the flat expression it was looked up with, and the constant-folded, hash-consed DAG
+// that the function was generated from.
+struct CachedFunction {
+    // libjit does not report the size of generated code, so entries are charged an estimate
+    // based on the number of DAG nodes. The charge covers the scalar function and the batch
+    // kernel, which lands in the same context once it is first run, whether that happens or not.
+    static constexpr size_t function_overhead_bytes = 128;
+    static constexpr size_t bytes_per_node = 16;
+
+    const FlatExpr source;
+    const FlatExpr dag;
+    const size_t arity;
+    const size_t code_size;
+    const std::shared_ptr<jit_context> context;
+    UserFunction function;
+
+    // Without a context the entry gets one of its own
+    CachedFunction(FlatExpr source_, size_t arity, std::shared_ptr<jit_context> context_ = nullptr):
+        source{std::move(source_)}, dag{build_dag(fold_constants(source))}, arity{arity},
+        code_size{2 * (function_overhead_bytes + dag.nodes.size() * bytes_per_node)},
+        context{context_ ? std::move(context_) : std::make_shared<jit_context>()}, function(*context, dag, arity)
+    {
+        // the batch kernel is left to the on-demand compiler, most entries never run it
+        function.compile_now();
+    }
+};
+
+// Key of a compiled function: the structural hash of the expression mixed with its number of
+// identifier slots. Equal keys still have to be confirmed by comparing arity and expression.
+inline uint64_t compile_key(const FlatExpr &flat, size_t arity)
+{
+    return structural_hash(flat) ^ (static_cast<uint64_t>(arity) * 0xff51afd7ed558ccdull);
+}
+
+// Compiled-function cache keyed by the structural hash of the expression and the number of
+// identifier slots. New entries are compiled into the context of the current generation, which
+// is closed once it holds a quarter of the memory budget. Generations are evicted least recently
+// used first: every hit or insert marks the entry's generation as used, and when the total code
+// size goes over the budget, whole generations are dropped, so dropping one actually frees its
+// code. A hot formula keeps its generation alive. The current generation is always kept, and the
+// budget is only as exact as the code size estimate of CachedFunction. Dropped functions stay
+// valid for as long as a caller still holds the shared_ptr returned by get().
+class CompileCache {
+    public:
+        struct Stats {
+            size_t hits = 0;
+            size_t misses = 0;
+            size_t evictions = 0;
+            size_t entries = 0;
+            size_t code_bytes = 0;
+            size_t generations = 0;
+        };
+
+        explicit CompileCache(size_t memory_budget): memory_budget{memory_budget} {}
+
+        std::shared_ptr<CachedFunction> get(FlatExpr flat, size_t arity)
+        {
+            uint64_t key = compile_key(flat, arity);
+
+            auto range = index.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it) {
+                auto &entry = it->second->function;
+                if (entry->arity == arity && entry->source == flat) {
+                    counters.hits++;
+                    it->second->generation->last_use = ++clock;
+                    return entry;
+                }
+            }
+
+            counters.misses++;
+            if (generations.empty() || generations.back().code_bytes >= memory_budget / generation_count) {
+                generations.emplace_back();
+                counters.generations++;
+            }
+            Generation &current = generations.back();
+            auto entry = std::make_shared<CachedFunction>(std::move(flat), arity, current.context);
+            current.last_use = ++clock;
+            current.entries.emplace_front(key, entry, &current);
+            current.code_bytes += entry->code_size;
+            index.emplace(key, current.entries.begin());
+            counters.code_bytes += entry->code_size;
+            counters.entries++;
+            evict();
+            return entry;
+        }
+
+        std::shared_ptr<CachedFunction> get(const ExprAST &ast, size_t arity)
+        {
+            return get(flatten(ast), arity);
+        }
+
+        std::shared_ptr<CachedFunction> get(const ExprAST &ast, const SymbolTable &symbols)
+        {
+            return get(ast, symbols.size());
+        }
+
+        Stats stats() const { return counters; }
+
+        size_t budget() const { return memory_budget; }
+
+        void set_budget(size_t bytes)
+        {
+            memory_budget = bytes;
+            evict();
+        }
+
+    private:
+        // the budget is split into this many generations
+        static constexpr size_t generation_count = 4;
+
+        struct Generation;
+
+        struct Entry {
+            uint64_t key;
+            std::shared_ptr<CachedFunction> function;
+            Generation *generation;
+
+            Entry(uint64_t key, std::shared_ptr<CachedFunction> function, Generation *generation):
+                key{key}, function{std::move(function)}, generation{generation} {}
+        };
+
+        struct Generation {
+            std::shared_ptr<jit_context> context = std::make_shared<jit_context>();
+            std::list<Entry> entries;
+            size_t code_bytes = 0;
+            // value of the cache's clock at the last hit or insert
+            uint64_t last_use = 0;
+        };
+
+        size_t memory_budget;
+        Stats counters;
+        uint64_t clock = 0;
+        // oldest first, the list keeps generations and their entries in place, so the index and
+        // the entries' generation pointers stay valid
+        std::list<Generation> generations;
+        std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index;
+
+        void evict()
+        {
+            while (counters.code_bytes > memory_budget && generations.size() > 1) {
+                // least recently used, never the current generation at the back
+                auto victim = generations.begin();
+                for (auto it = generations.begin(); it != std::prev(generations.end()); ++it) {
+                    if (it->last_use < victim->last_use) {
+                        victim = it;
+                    }
+                }
+                Generation &generation = *victim;
+                for (auto entry = generation.entries.begin(); entry != generation.entries.end(); ++entry) {
+                    auto range = index.equal_range(entry->key);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second == entry) {
+                            index.erase(it);
+                            break;
+                        }
+                    }
+                }
+                counters.code_bytes -= generation.code_bytes;
+                counters.entries -= generation.entries.size();
+                counters.evictions += generation.entries.size();
+                counters.generations--;
+                generations.erase(victim);
+            }
+        }
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "ast.h"
+#include "flat.h"
+#include "compile_cache.h"
+
+// Thread-safe compiled-function store for many request threads. Keys are spread over shards that
+// each have their own lock, and a lock is only held for the lookup, never while compiling.
+// Compilation is single-flight: the first request for an expression compiles it, requests for
+// the same expression that arrive meanwhile wait for that result instead of compiling again.
+// Entries are never evicted, CompileCache is the single-threaded variant with a memory budget.
+class CompileService {
+    public:
+        struct Stats {
+            size_t requests = 0;
+            size_t compiles = 0;
+            // requests that found the expression still being compiled by another thread
+            size_t waits = 0;
+            size_t failures = 0;
+            double compile_seconds = 0;
+            double wait_seconds = 0;
+        };
+
+        explicit CompileService(size_t shard_count = 64):
+            shard_count{std::max<size_t>(shard_count, 1)}, shards{std::make_unique<Shard[]>(this->shard_count)} {}
+
+        CompileService(const CompileService&) = delete;
+        CompileService &operator=(const CompileService&) = delete;
+
+        // Returns the compiled function for the expression, compiling it if no other request did.
+        // Exceptions from the compile are passed on to every request that waited for it, and
+        // the failed entry is dropped so a later request tries again.
+        std::shared_ptr<CachedFunction> get(FlatExpr flat, size_t arity)
+        {
+            using clock = std::chrono::steady_clock;
+
+            uint64_t key = compile_key(flat, arity);
+            Shard &shard = shards[(key >> 32) % shard_count];
+            counters.requests++;
+
+            // the expression moves into a candidate slot before the lock is taken, so the critical
+            // section does not grow with the size of the formula
+            std::promise<std::shared_ptr<CachedFunction>> promise;
+            auto candidate = std::make_shared<Slot>(Slot{std::move(flat), arity, promise.get_future().share()});
+            std::shared_ptr<Slot> slot;
+            {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                auto range = shard.slots.equal_range(key);
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (it->second->arity == arity && it->second->source == candidate->source) {
+                        slot = it->second;
+                        break;
+                    }
+                }
+                if (!slot) {
+                    shard.slots.emplace(key, candidate);
+                }
+            }
+            if (!slot) {
+                return compile(shard, key, candidate->source, arity, promise, candidate);
+            }
+
+            auto &result = slot->result;
+            if (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                counters.waits++;
+                auto start = clock::now();
+                result.wait();
+                add_elapsed(counters.wait_nanoseconds, start);
+            }
+            return result.get();
+        }
+
+        std::shared_ptr<CachedFunction> get(const ExprAST &ast, size_t arity)
+        {
+            return get(flatten(ast), arity);
+        }
+
+        std::shared_ptr<CachedFunction> get(const ExprAST &ast, const SymbolTable &symbols)
+        {
+            return get(ast, symbols.size());
+        }
+
+        Stats stats() const
+        {
+            Stats stats;
+            stats.requests = counters.requests;
+            stats.compiles = counters.compiles;
+            stats.waits = counters.waits;
+            stats.failures = counters.failures;
+            stats.compile_seconds = counters.compile_nanoseconds * 1e-9;
+            stats.wait_seconds = counters.wait_nanoseconds * 1e-9;
+            return stats;
+        }
+
+        size_t size() const
+        {
+            size_t entries = 0;
+            for (size_t i = 0; i < shard_count; i++) {
+                std::lock_guard<std::mutex> guard(shards[i].lock);
+                entries += shards[i].slots.size();
+            }
+            return entries;
+        }
+
+    private:
+        struct Slot {
+            FlatExpr source;
+            size_t arity;
+            std::shared_future<std::shared_ptr<CachedFunction>> result;
+        };
+
+        // a cache line each, so threads locking neighbouring shards do not share one
+        struct alignas(64) Shard {
+            mutable std::mutex lock;
+            std::unordered_multimap<uint64_t, std::shared_ptr<Slot>> slots;
+        };
+
+        struct Counters {
+            std::atomic<size_t> requests{0};
+            std::atomic<size_t> compiles{0};
+            std::atomic<size_t> waits{0};
+            std::atomic<size_t> failures{0};
+            std::atomic<uint64_t> compile_nanoseconds{0};
+            std::atomic<uint64_t> wait_nanoseconds{0};
+        };
+
+        const size_t shard_count;
+        std::unique_ptr<Shard[]> shards;
+        Counters counters;
+
+        static void add_elapsed(std::atomic<uint64_t> &total, std::chrono::steady_clock::time_point start)
+        {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            total += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        }
+
+        std::shared_ptr<CachedFunction> compile(Shard &shard, uint64_t key, FlatExpr flat, size_t arity,
+                                                std::promise<std::shared_ptr<CachedFunction>> &promise,
+                                                const std::shared_ptr<Slot> &slot)
+        {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                auto function = std::make_shared<CachedFunction>(std::move(flat), arity);
+                counters.compiles++;
+                add_elapsed(counters.compile_nanoseconds, start);
+                promise.set_value(function);
+                return function;
+            } catch (...) {
+                counters.failures++;
+                {
+                    std::lock_guard<std::mutex> guard(shard.lock);
+                    auto range = shard.slots.equal_range(key);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second == slot) {
+                            shard.slots.erase(it);
+                            break;
+                        }
+                    }
+                }
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+        }
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <memory>
+
+#include "ast.h"
+#include "ast_util.h"
+
+// Constant folding: rebuilds the tree with every subtree that only depends on numbers replaced
+// by a single NumberExprAST. Operators are evaluated with the same libm calls libjit emits for
+// them, so the folded function returns bit-identical results.
+class ConstantFolder: public Visitor {
+    std::unique_ptr<ExprAST> current_result;
+    size_t folded = 0;
+
+    static const NumberExprAST *as_number(const std::unique_ptr<ExprAST> &node)
+    {
+        return dynamic_cast<const NumberExprAST*>(node.get());
+    }
+
+    public:
+        std::unique_ptr<ExprAST> fold(const ExprAST &ast)
+        {
+            ast.accept(this);
+            return std::move(current_result);
+        }
+
+        // number of operator nodes that were evaluated at compile time
+        size_t folded_count() const { return folded; }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            auto lhs = fold(*node->lhs);
+            auto rhs = fold(*node->rhs);
+            auto lhs_number = as_number(lhs);
+            auto rhs_number = as_number(rhs);
+            if (lhs_number && rhs_number) {
+                current_result = std::make_unique<NumberExprAST>(evaluate(node->op, lhs_number->value, rhs_number->value));
+                folded++;
+            } else {
+                current_result = std::make_unique<BinaryExprAST>(node->op, std::move(lhs), std::move(rhs));
+            }
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            auto arg = fold(*node->arg);
+            if (auto number = as_number(arg)) {
+                current_result = std::make_unique<NumberExprAST>(evaluate(node->op, number->value));
+                folded++;
+            } else {
+                current_result = std::make_unique<UnaryExprAST>(node->op, std::move(arg));
+            }
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = std::make_unique<NumberExprAST>(node->value);
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = std::make_unique<IdentifierExprAST>(node->slot);
+        }
+};
+
+inline std::unique_ptr<ExprAST> fold_constants(const ExprAST &ast)
+{
+    return ConstantFolder().fold(ast);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <jit/jit-plus.h>
+
+#include "user_function.h"
+
+// One jit_context per compiling thread. libjit serialises everything built in a context behind
+// its build lock, so threads that share a context compile one at a time; with a context each
+// they never contend. The pool owns the contexts, so code compiled by a thread stays valid after
+// that thread exits and can be called from any thread. Functions compiled through the pool must
+// be destroyed before the pool.
+class ContextPool {
+    // distinguishes pools in the thread-local cache, addresses can be reused
+    const uint64_t id;
+    std::mutex lock;
+    std::unordered_map<std::thread::id, std::unique_ptr<jit_context>> contexts;
+
+    struct LocalContext {
+        uint64_t pool_id = 0;
+        jit_context *context = nullptr;
+    };
+
+    static uint64_t next_id()
+    {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
+
+    // context of the last pool the calling thread used, so repeated compiles skip the map lookup
+    static LocalContext &local_context()
+    {
+        static thread_local LocalContext local;
+        return local;
+    }
+
+    public:
+        ContextPool(): id{next_id()} {}
+
+        ContextPool(const ContextPool&) = delete;
+        ContextPool &operator=(const ContextPool&) = delete;
+
+        // The calling thread's context, created on its first use
+        jit_context &local()
+        {
+            LocalContext &cached = local_context();
+            if (cached.pool_id == id) {
+                return *cached.context;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            auto &context = contexts[std::this_thread::get_id()];
+            if (!context) {
+                context = std::make_unique<jit_context>();
+            }
+            cached = LocalContext{id, context.get()};
+            return *context;
+        }
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return contexts.size();
+        }
+
+        // Creates a Function (UserFunction, PackedUserFunction, ...) in the calling thread's
+        // context and compiles it before returning, so the expression is no longer referenced
+        // and the first call does not go through the on-demand compiler
+        template <typename Function = UserFunction>
+        std::unique_ptr<Function> compile(Expression expression, size_t arity)
+        {
+            auto function = std::make_unique<Function>(local(), expression, arity);
+            function->compile_now();
+            return function;
+        }
+
+        template <typename Function = UserFunction>
+        std::unique_ptr<Function> compile(Expression expression, const SymbolTable &symbols)
+        {
+            return compile<Function>(expression, symbols.size());
+        }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <unordered_map>
+#include <cstdint>
+
+#include "ast.h"
+#include "flat.h"
+
+// Hash-consing builder for the flat form: asking for a node that already exists returns the
+// existing index, so equal subtrees collapse into one shared node no matter how often they are
+// built. The result is a FlatExpr in which every distinct subexpression is stored once.
+class DagBuilder: public Visitor {
+    FlatExpr dag;
+    std::unordered_map<FlatNode, uint32_t, FlatNodeHash> unique;
+    uint32_t current_result;
+
+    uint32_t intern(const FlatNode &node)
+    {
+        auto inserted = unique.emplace(node, dag.nodes.size());
+        if (inserted.second) {
+            dag.push(node);
+        }
+        return inserted.first->second;
+    }
+
+    public:
+        uint32_t number(jit_float64 value) { return intern(FlatNode::number(value)); }
+        uint32_t identifier(uint32_t slot) { return intern(FlatNode::identifier(slot)); }
+        uint32_t unary(UnaryOperator op, uint32_t arg) { return intern(FlatNode::unary(op, arg)); }
+        uint32_t binary(BinaryOperator op, uint32_t lhs, uint32_t rhs) { return intern(FlatNode::binary(op, lhs, rhs)); }
+
+        // Adds a whole tree, returns the index of its root
+        uint32_t add(const ExprAST &ast)
+        {
+            ast.accept(this);
+            return current_result;
+        }
+
+        // Adds a flat expression in one linear pass, returns the index of its root
+        uint32_t add(const FlatExpr &flat)
+        {
+            std::vector<uint32_t> remap(flat.nodes.size());
+            for (size_t i = 0; i < flat.nodes.size(); i++) {
+                FlatNode node = flat.nodes[i];
+                if (node.kind == FlatNode::Kind::Unary) {
+                    node.lhs = remap[node.lhs];
+                } else if (node.kind == FlatNode::Kind::Binary) {
+                    node.lhs = remap[node.lhs];
+                    node.rhs = remap[node.rhs];
+                }
+                remap[i] = intern(node);
+            }
+            return remap[flat.root];
+        }
+
+        // Hands out the DAG rooted at `root`, the builder is empty afterwards
+        FlatExpr finish(uint32_t root)
+        {
+            FlatExpr result = std::move(dag);
+            result.root = root;
+            dag = FlatExpr();
+            unique.clear();
+            return result;
+        }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            uint32_t lhs = add(*node->lhs);
+            uint32_t rhs = add(*node->rhs);
+            current_result = binary(node->op, lhs, rhs);
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            current_result = unary(node->op, add(*node->arg));
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = number(node->value);
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = identifier(node->slot);
+        }
+};
+
+inline FlatExpr build_dag(const ExprAST &ast)
+{
+    DagBuilder builder;
+    return builder.finish(builder.add(ast));
+}
+
+inline FlatExpr build_dag(const FlatExpr &flat)
+{
+    DagBuilder builder;
+    return builder.finish(builder.add(flat));
+}
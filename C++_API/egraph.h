@@ -0,0 +1,534 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "ast_util.h"
+#include "flat.h"
+#include "rewrite.h"
+
+// Estimated latency in cycles per node, the e-graph optimiser extracts the equivalent expression
+// with the lowest sum. Libm calls are priced as a typical call of the x86-64 glibc implementation.
+// Operator costs have to be positive.
+struct CostModel {
+    jit_float64 number = 0;
+    jit_float64 identifier = 1;
+    // indexed by BinaryOperator: Plus, Minus, Mult, Div, Pow. Pow is priced as the libm call, a
+    // constant exponent is usually cheaper once expanded, see power.h
+    jit_float64 binary[5] = {4, 4, 4, 14, 80};
+    // indexed by UnaryOperator: Acos, Asin, Atan, Cos, Cosh, Exp, Log10, Sin, Sinh, Sqrt, Tan, Tanh
+    jit_float64 unary[12] = {60, 60, 50, 45, 60, 40, 45, 45, 60, 18, 60, 60};
+
+    static_assert(sizeof(binary) / sizeof(binary[0]) == binary_operator_count,
+                  "CostModel::binary needs one entry per BinaryOperator");
+    static_assert(sizeof(unary) / sizeof(unary[0]) == unary_operator_count,
+                  "CostModel::unary needs one entry per UnaryOperator");
+
+    jit_float64 cost(const FlatNode &node) const
+    {
+        switch(node.kind) {
+            case FlatNode::Kind::Number:
+                return number;
+            case FlatNode::Kind::Identifier:
+                return identifier;
+            case FlatNode::Kind::Unary:
+                return unary[node.op];
+            case FlatNode::Kind::Binary:
+                return binary[node.op];
+        }
+        return 0;
+    }
+
+    // Cost of evaluating the tree, every node counted as often as it occurs
+    jit_float64 cost(const ExprAST &ast) const
+    {
+        jit_float64 total = 0;
+        for (auto &node: flatten(ast).nodes) {
+            total += cost(node);
+        }
+        return total;
+    }
+};
+
+// Equality graph: every class is a set of equivalent nodes, and node children are classes, so
+// one graph holds every form the rewrites found at once. Classes are merged with union-find,
+// and classes whose value is known are tracked so equal constants end up in one class.
+class EGraph {
+    public:
+        static constexpr uint32_t none = UINT32_MAX;
+
+    private:
+        struct EClass {
+            // children are class ids, canonical right after rebuild()
+            std::vector<FlatNode> nodes;
+            bool constant = false;
+            jit_float64 value = 0;
+        };
+
+        std::vector<uint32_t> parent;
+        std::vector<EClass> classes;
+        std::unordered_map<FlatNode, uint32_t, FlatNodeHash> memo;
+        size_t node_count = 0;
+        // bumped by every new node and every merge
+        size_t changes = 0;
+
+        static bool less(const FlatNode &lhs, const FlatNode &rhs)
+        {
+            if (lhs.kind != rhs.kind) {
+                return lhs.kind < rhs.kind;
+            }
+            if (lhs.op != rhs.op) {
+                return lhs.op < rhs.op;
+            }
+            if (lhs.lhs != rhs.lhs) {
+                return lhs.lhs < rhs.lhs;
+            }
+            return lhs.payload < rhs.payload;
+        }
+
+        FlatNode canonical(FlatNode node)
+        {
+            if (node.kind == FlatNode::Kind::Unary || node.kind == FlatNode::Kind::Binary) {
+                node.lhs = find(node.lhs);
+            }
+            if (node.kind == FlatNode::Kind::Binary) {
+                node.rhs = find(node.rhs);
+            }
+            return node;
+        }
+
+        // value of node if all its children have known values
+        bool fold(const FlatNode &node, jit_float64 &value)
+        {
+            if (node.kind == FlatNode::Kind::Unary && classes[find(node.lhs)].constant) {
+                value = evaluate(node.unary_op(), classes[find(node.lhs)].value);
+                return true;
+            }
+            if (node.kind == FlatNode::Kind::Binary && classes[find(node.lhs)].constant && classes[find(node.rhs)].constant) {
+                value = evaluate(node.binary_op(), classes[find(node.lhs)].value, classes[find(node.rhs)].value);
+                return true;
+            }
+            return false;
+        }
+
+    public:
+        uint32_t find(uint32_t id)
+        {
+            while (parent[id] != id) {
+                parent[id] = parent[parent[id]];
+                id = parent[id];
+            }
+            return id;
+        }
+
+        // Returns the class of the node, adding it if the graph has no equal node yet
+        uint32_t add(FlatNode node)
+        {
+            node = canonical(node);
+            auto it = memo.find(node);
+            if (it != memo.end()) {
+                return find(it->second);
+            }
+            uint32_t id = classes.size();
+            parent.push_back(id);
+            classes.emplace_back();
+            classes[id].nodes.push_back(node);
+            memo.emplace(node, id);
+            node_count++;
+            changes++;
+
+            jit_float64 value;
+            if (node.kind == FlatNode::Kind::Number) {
+                classes[id].constant = true;
+                classes[id].value = node.value;
+            } else if (fold(node, value)) {
+                merge(id, add(FlatNode::number(value)));
+            }
+            return find(id);
+        }
+
+        // Adds every node of a flat expression, returns the class of its root
+        uint32_t add(const FlatExpr &flat)
+        {
+            std::vector<uint32_t> ids(flat.nodes.size());
+            for (size_t i = 0; i < flat.nodes.size(); i++) {
+                FlatNode node = flat.nodes[i];
+                if (node.kind == FlatNode::Kind::Unary || node.kind == FlatNode::Kind::Binary) {
+                    node.lhs = ids[node.lhs];
+                }
+                if (node.kind == FlatNode::Kind::Binary) {
+                    node.rhs = ids[node.rhs];
+                }
+                ids[i] = add(node);
+            }
+            return ids[flat.root];
+        }
+
+        // Returns false if both already were one class. Call rebuild() before the next search.
+        bool merge(uint32_t a, uint32_t b)
+        {
+            a = find(a);
+            b = find(b);
+            if (a == b) {
+                return false;
+            }
+            if (classes[a].nodes.size() < classes[b].nodes.size()) {
+                std::swap(a, b);
+            }
+            parent[b] = a;
+            auto &nodes = classes[b].nodes;
+            classes[a].nodes.insert(classes[a].nodes.end(), nodes.begin(), nodes.end());
+            nodes.clear();
+            nodes.shrink_to_fit();
+            if (!classes[a].constant && classes[b].constant) {
+                classes[a].constant = true;
+                classes[a].value = classes[b].value;
+            }
+            changes++;
+            return true;
+        }
+
+        // Restores the invariants merges break: nodes whose children became equal are merged
+        // into one class (congruence), and nodes whose children all became constant are folded
+        void rebuild()
+        {
+            for (bool changed = true; changed;) {
+                changed = false;
+                memo.clear();
+                std::vector<std::pair<uint32_t, uint32_t>> congruent;
+                std::vector<std::pair<uint32_t, jit_float64>> folded;
+                for (uint32_t id = 0; id < classes.size(); id++) {
+                    if (find(id) != id) {
+                        continue;
+                    }
+                    auto &nodes = classes[id].nodes;
+                    for (auto &node: nodes) {
+                        node = canonical(node);
+                    }
+                    std::sort(nodes.begin(), nodes.end(), less);
+                    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+                    for (auto &node: nodes) {
+                        auto inserted = memo.emplace(node, id);
+                        if (!inserted.second && inserted.first->second != id) {
+                            congruent.emplace_back(inserted.first->second, id);
+                        }
+                        jit_float64 value;
+                        if (!classes[id].constant && fold(node, value)) {
+                            folded.emplace_back(id, value);
+                        }
+                    }
+                }
+                for (auto &pair: congruent) {
+                    changed |= merge(pair.first, pair.second);
+                }
+                for (auto &constant: folded) {
+                    changed |= merge(constant.first, add(FlatNode::number(constant.second)));
+                }
+            }
+            node_count = memo.size();
+        }
+
+        size_t size() const { return node_count; }
+        size_t version() const { return changes; }
+
+        size_t class_count()
+        {
+            size_t count = 0;
+            for (uint32_t id = 0; id < classes.size(); id++) {
+                count += find(id) == id;
+            }
+            return count;
+        }
+
+        const std::vector<FlatNode> &nodes(uint32_t id) { return classes[find(id)].nodes; }
+        bool is_constant(uint32_t id) { return classes[find(id)].constant; }
+        jit_float64 constant(uint32_t id) { return classes[find(id)].value; }
+
+        // ids of all classes, valid until the next merge
+        std::vector<uint32_t> class_ids()
+        {
+            std::vector<uint32_t> ids;
+            for (uint32_t id = 0; id < classes.size(); id++) {
+                if (find(id) == id) {
+                    ids.push_back(id);
+                }
+            }
+            return ids;
+        }
+
+        // Cheapest tree in the class of root under the cost model, its cost goes to *cost
+        std::unique_ptr<ExprAST> extract(uint32_t root, const CostModel &model, jit_float64 *cost = nullptr)
+        {
+            constexpr jit_float64 infinity = std::numeric_limits<jit_float64>::infinity();
+            std::vector<jit_float64> best_cost(classes.size(), infinity);
+            std::vector<FlatNode> best_node(classes.size(), FlatNode::number(0));
+
+            // relax until no class gets cheaper, children always cost less than their users
+            auto ids = class_ids();
+            for (bool changed = true; changed;) {
+                changed = false;
+                for (uint32_t id: ids) {
+                    for (auto &node: classes[id].nodes) {
+                        jit_float64 total = model.cost(node);
+                        if (node.kind == FlatNode::Kind::Unary || node.kind == FlatNode::Kind::Binary) {
+                            total += best_cost[find(node.lhs)];
+                        }
+                        if (node.kind == FlatNode::Kind::Binary) {
+                            total += best_cost[find(node.rhs)];
+                        }
+                        if (total < best_cost[id]) {
+                            best_cost[id] = total;
+                            best_node[id] = node;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+            if (cost) {
+                *cost = best_cost[find(root)];
+            }
+            return build(find(root), best_node);
+        }
+
+    private:
+        std::unique_ptr<ExprAST> build(uint32_t id, const std::vector<FlatNode> &best_node)
+        {
+            const FlatNode &node = best_node[id];
+            switch(node.kind) {
+                case FlatNode::Kind::Number:
+                    return std::make_unique<NumberExprAST>(node.value);
+                case FlatNode::Kind::Identifier:
+                    return std::make_unique<IdentifierExprAST>(node.slot);
+                case FlatNode::Kind::Unary:
+                    return std::make_unique<UnaryExprAST>(node.unary_op(), build(find(node.lhs), best_node));
+                case FlatNode::Kind::Binary:
+                    return std::make_unique<BinaryExprAST>(node.binary_op(), build(find(node.lhs), best_node),
+                                                           build(find(node.rhs), best_node));
+            }
+            return nullptr;
+        }
+};
+
+// standard_rules() plus the rules that only pay off when every form is kept: commutativity (exact),
+// associativity and factoring (fast-math). Applied greedily they would loop or grow the tree.
+// Variables are named x, y, z here, c would only match numbers.
+inline RewriteRules egraph_rules()
+{
+    RewriteRules rules = standard_rules();
+    rules.add("commute-plus", "x+y", "y+x", true)
+         .add("commute-mult", "x*y", "y*x", true)
+         .add("double", "x+x", "2*x", true)
+         .add("associate-plus", "(x+y)+z", "x+(y+z)", false)
+         .add("associate-plus-left", "x+(y+z)", "(x+y)+z", false)
+         .add("associate-mult", "(x*y)*z", "x*(y*z)", false)
+         .add("associate-mult-left", "x*(y*z)", "(x*y)*z", false)
+         .add("factor", "x*y+x*z", "x*(y+z)", false)
+         .add("factor-minus", "x*y-x*z", "x*(y-z)", false);
+    return rules;
+}
+
+// Limits of one optimisation, whichever is reached first ends the search
+struct EGraphBudget {
+    size_t max_nodes = 20000;
+    size_t max_iterations = 16;
+    double max_seconds = 0.05;
+};
+
+struct EGraphReport {
+    size_t iterations = 0;
+    size_t nodes = 0;
+    size_t classes = 0;
+    // no rule could add anything new, the extracted expression is the best the rules allow
+    bool saturated = false;
+    double seconds = 0;
+    // estimated cycles of the input and of the extracted expression
+    jit_float64 cost_before = 0;
+    jit_float64 cost_after = 0;
+
+    double estimated_speedup() const { return cost_after > 0 ? cost_before / cost_after : 1; }
+};
+
+// Equality saturation: the input goes into an e-graph, every rule is matched against every class
+// and its replacement merged in, round after round until nothing changes or the budget runs out,
+// and the cheapest equivalent tree under the cost model is extracted. The result is a plain
+// ExprAST for the usual codegen.
+class EGraphOptimizer {
+    using Substitution = std::vector<uint32_t>;
+
+    const RewriteRules &rules;
+    const RewriteMode mode;
+    const CostModel model;
+    const EGraphBudget budget;
+    EGraphReport last_report;
+
+    static void ematch(EGraph &graph, const RewriteRule &rule, uint32_t index, uint32_t id,
+                       const Substitution &substitution, std::vector<Substitution> &matches)
+    {
+        const FlatNode &pattern = rule.pattern.nodes[index];
+        id = graph.find(id);
+        switch(pattern.kind) {
+            case FlatNode::Kind::Number:
+                if (graph.is_constant(id)) {
+                    jit_float64 value = graph.constant(id);
+                    if (std::memcmp(&value, &pattern.value, sizeof(value)) == 0) {
+                        matches.push_back(substitution);
+                    }
+                }
+                return;
+            case FlatNode::Kind::Identifier:
+                if (rule.constant_only[pattern.slot] && !graph.is_constant(id)) {
+                    return;
+                }
+                if (substitution[pattern.slot] == EGraph::none) {
+                    matches.push_back(substitution);
+                    matches.back()[pattern.slot] = id;
+                } else if (graph.find(substitution[pattern.slot]) == id) {
+                    matches.push_back(substitution);
+                }
+                return;
+            case FlatNode::Kind::Unary:
+                for (auto &node: graph.nodes(id)) {
+                    if (node.kind == FlatNode::Kind::Unary && node.op == pattern.op) {
+                        ematch(graph, rule, pattern.lhs, node.lhs, substitution, matches);
+                    }
+                }
+                return;
+            case FlatNode::Kind::Binary:
+                for (auto &node: graph.nodes(id)) {
+                    if (node.kind == FlatNode::Kind::Binary && node.op == pattern.op) {
+                        std::vector<Substitution> lhs_matches;
+                        ematch(graph, rule, pattern.lhs, node.lhs, substitution, lhs_matches);
+                        for (auto &lhs_match: lhs_matches) {
+                            ematch(graph, rule, pattern.rhs, node.rhs, lhs_match, matches);
+                        }
+                    }
+                }
+                return;
+        }
+    }
+
+    static uint32_t instantiate(EGraph &graph, const RewriteRule &rule, uint32_t index, const Substitution &substitution)
+    {
+        const FlatNode &node = rule.replacement.nodes[index];
+        switch(node.kind) {
+            case FlatNode::Kind::Number:
+                return graph.add(node);
+            case FlatNode::Kind::Identifier:
+                return substitution[node.slot];
+            case FlatNode::Kind::Unary:
+                return graph.add(FlatNode::unary(node.unary_op(), instantiate(graph, rule, node.lhs, substitution)));
+            case FlatNode::Kind::Binary: {
+                uint32_t lhs = instantiate(graph, rule, node.lhs, substitution);
+                uint32_t rhs = instantiate(graph, rule, node.rhs, substitution);
+                return graph.add(FlatNode::binary(node.binary_op(), lhs, rhs));
+            }
+        }
+        return EGraph::none;
+    }
+
+    // guards only get to see the constant variables
+    static bool guard_allows(EGraph &graph, const RewriteRule &rule, const Substitution &substitution)
+    {
+        if (!rule.guard) {
+            return true;
+        }
+        std::deque<NumberExprAST> numbers;
+        std::vector<const ExprAST*> bound(rule.variables.size(), nullptr);
+        for (size_t i = 0; i < bound.size(); i++) {
+            if (rule.constant_only[i]) {
+                bound[i] = &numbers.emplace_back(graph.constant(substitution[i]));
+            }
+        }
+        return rule.guard(RewriteMatch(rule, bound));
+    }
+
+    public:
+        EGraphOptimizer(const RewriteRules &rules, RewriteMode mode, const CostModel &model = CostModel(),
+                        const EGraphBudget &budget = EGraphBudget()):
+            rules{rules}, mode{mode}, model{model}, budget{budget} {}
+
+        // the rules are kept by reference and have to outlive the optimiser
+        EGraphOptimizer(RewriteRules &&rules, RewriteMode mode, const CostModel &model = CostModel(),
+                        const EGraphBudget &budget = EGraphBudget()) = delete;
+
+        std::unique_ptr<ExprAST> optimize(const ExprAST &ast)
+        {
+            using clock = std::chrono::steady_clock;
+            auto start = clock::now();
+            auto out_of_time = [&] {
+                return std::chrono::duration<double>(clock::now() - start).count() > budget.max_seconds;
+            };
+
+            struct Match {
+                const RewriteRule *rule;
+                uint32_t id;
+                Substitution substitution;
+            };
+
+            EGraphReport report;
+            report.cost_before = model.cost(ast);
+
+            EGraph graph;
+            uint32_t root = graph.add(flatten(ast));
+            graph.rebuild();
+
+            bool exhausted = false;
+            for (report.iterations = 0; report.iterations < budget.max_iterations && !exhausted; report.iterations++) {
+                // search everything first, then apply, so matches see a consistent graph
+                std::vector<Match> matches;
+                for (size_t r = 0; r < rules.size() && !exhausted; r++) {
+                    const RewriteRule &rule = rules[r];
+                    if (!rule.exact && mode == RewriteMode::BitExact) {
+                        continue;
+                    }
+                    for (uint32_t id: graph.class_ids()) {
+                        if (exhausted) {
+                            break;
+                        }
+                        std::vector<Substitution> found;
+                        ematch(graph, rule, rule.pattern.root, id, Substitution(rule.variables.size(), EGraph::none), found);
+                        for (auto &substitution: found) {
+                            matches.push_back({&rule, id, std::move(substitution)});
+                        }
+                        exhausted = graph.size() + matches.size() > budget.max_nodes || out_of_time();
+                    }
+                }
+
+                size_t version = graph.version();
+                for (size_t i = 0; i < matches.size(); i++) {
+                    const Match &match = matches[i];
+                    if (graph.size() > budget.max_nodes || (i % 256 == 0 && out_of_time())) {
+                        exhausted = true;
+                        break;
+                    }
+                    if (guard_allows(graph, *match.rule, match.substitution)) {
+                        graph.merge(match.id, instantiate(graph, *match.rule, match.rule->replacement.root, match.substitution));
+                    }
+                }
+                graph.rebuild();
+                if (graph.version() == version) {
+                    report.saturated = !exhausted;
+                    report.iterations++;
+                    break;
+                }
+                exhausted = exhausted || out_of_time();
+            }
+
+            auto result = graph.extract(root, model, &report.cost_after);
+            report.nodes = graph.size();
+            report.classes = graph.class_count();
+            report.seconds = std::chrono::duration<double>(clock::now() - start).count();
+            last_report = report;
+            return result;
+        }
+
+        const EGraphReport &report() const { return last_report; }
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "ast.h"
+#include "ast_util.h"
+
+// 16 byte node of the flat expression form. Children are indices into FlatExpr::nodes and
+// always smaller than the index of the node itself.
+struct FlatNode {
+    enum class Kind: uint8_t {
+        Number,
+        Identifier,
+        Unary,
+        Binary,
+    };
+
+    Kind kind;
+    uint8_t op;
+    // Unary: argument, Binary: left operand
+    uint32_t lhs;
+    // Number: value, Identifier: slot, Binary: right operand. Unused bytes are always zero,
+    // so two nodes are equal exactly when their bytes are equal.
+    union {
+        jit_float64 value;
+        uint32_t slot;
+        uint32_t rhs;
+        uint64_t payload;
+    };
+
+    static FlatNode number(jit_float64 value)
+    {
+        FlatNode node(Kind::Number, 0, 0);
+        node.value = value;
+        return node;
+    }
+
+    static FlatNode identifier(uint32_t slot)
+    {
+        FlatNode node(Kind::Identifier, 0, 0);
+        node.slot = slot;
+        return node;
+    }
+
+    static FlatNode unary(UnaryOperator op, uint32_t arg)
+    {
+        return FlatNode(Kind::Unary, static_cast<uint8_t>(op), arg);
+    }
+
+    static FlatNode binary(BinaryOperator op, uint32_t lhs, uint32_t rhs)
+    {
+        FlatNode node(Kind::Binary, static_cast<uint8_t>(op), lhs);
+        node.rhs = rhs;
+        return node;
+    }
+
+    UnaryOperator unary_op() const { return static_cast<UnaryOperator>(op); }
+    BinaryOperator binary_op() const { return static_cast<BinaryOperator>(op); }
+
+    bool operator==(const FlatNode &other) const
+    {
+        return kind == other.kind && op == other.op && lhs == other.lhs && payload == other.payload;
+    }
+
+    private:
+        FlatNode(Kind kind, uint8_t op, uint32_t lhs): kind{kind}, op{op}, lhs{lhs}, payload{0} {}
+};
+
+static_assert(sizeof(FlatNode) == 16, "FlatNode is meant to fit four nodes per cache line");
+
+// Hash of a single node, children are hashed by index
+struct FlatNodeHash {
+    size_t operator()(const FlatNode &node) const
+    {
+        uint64_t h = static_cast<uint64_t>(node.kind) | (uint64_t{node.op} << 8) | (uint64_t{node.lhs} << 32);
+        h ^= node.payload + 0x9e3779b97f4a7c15ull + (h << 12) + (h >> 4);
+        return h;
+    }
+};
+
+// Expression stored as a contiguous post-order array: a single forward pass visits every
+// child before its users, so codegen, folding and hashing are linear scans over `nodes`.
+// A FlatExpr built by DagBuilder may share nodes between several users.
+struct FlatExpr {
+    std::vector<FlatNode> nodes;
+    uint32_t root = 0;
+
+    uint32_t push(const FlatNode &node)
+    {
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    bool operator==(const FlatExpr &other) const
+    {
+        return root == other.root && nodes == other.nodes;
+    }
+};
+
+// Adapter from the Visitor based tree to the flat form
+class Flattener: public Visitor {
+    FlatExpr &flat;
+    uint32_t current_result;
+
+    public:
+        explicit Flattener(FlatExpr &flat): flat{flat} {}
+
+        uint32_t add(const ExprAST &ast)
+        {
+            ast.accept(this);
+            return current_result;
+        }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            uint32_t lhs = add(*node->lhs);
+            uint32_t rhs = add(*node->rhs);
+            current_result = flat.push(FlatNode::binary(node->op, lhs, rhs));
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            current_result = flat.push(FlatNode::unary(node->op, add(*node->arg)));
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = flat.push(FlatNode::number(node->value));
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = flat.push(FlatNode::identifier(node->slot));
+        }
+};
+
+inline FlatExpr flatten(const ExprAST &ast)
+{
+    FlatExpr flat;
+    Flattener flattener(flat);
+    flat.root = flattener.add(ast);
+    return flat;
+}
+
+// Adapter back to the tree, shared nodes are duplicated
+inline std::unique_ptr<ExprAST> to_ast(const FlatExpr &flat, uint32_t index)
+{
+    const FlatNode &node = flat.nodes[index];
+    switch(node.kind) {
+        case FlatNode::Kind::Number:
+            return std::make_unique<NumberExprAST>(node.value);
+        case FlatNode::Kind::Identifier:
+            return std::make_unique<IdentifierExprAST>(node.slot);
+        case FlatNode::Kind::Unary:
+            return std::make_unique<UnaryExprAST>(node.unary_op(), to_ast(flat, node.lhs));
+        case FlatNode::Kind::Binary:
+            return std::make_unique<BinaryExprAST>(node.binary_op(), to_ast(flat, node.lhs), to_ast(flat, node.rhs));
+    }
+    return nullptr;
+}
+
+inline std::unique_ptr<ExprAST> to_ast(const FlatExpr &flat)
+{
+    return to_ast(flat, flat.root);
+}
+
+// Structural (Merkle) hash of the expression rooted at flat.root, nodes that are not
+// reachable from the root do not contribute
+inline uint64_t structural_hash(const FlatExpr &flat)
+{
+    auto mix = [](uint64_t h, uint64_t v) { return h ^ (v + 0x9e3779b97f4a7c15ull + (h << 12) + (h >> 4)); };
+
+    std::vector<uint64_t> hashes(flat.nodes.size());
+    for (size_t i = 0; i < flat.nodes.size(); i++) {
+        const FlatNode &node = flat.nodes[i];
+        uint64_t h = mix(static_cast<uint64_t>(node.kind) + 1, node.op);
+        switch(node.kind) {
+            case FlatNode::Kind::Number:
+            case FlatNode::Kind::Identifier:
+                h = mix(h, node.payload);
+                break;
+            case FlatNode::Kind::Unary:
+                h = mix(h, hashes[node.lhs]);
+                break;
+            case FlatNode::Kind::Binary:
+                h = mix(mix(h, hashes[node.lhs]), hashes[node.rhs]);
+                break;
+        }
+        hashes[i] = h;
+    }
+    return flat.nodes.empty() ? 0 : hashes[flat.root];
+}
+
+// Constant folding on the flat form. Numbers are only materialized when a non-constant user
+// needs them, so the folded expression contains no dead constants.
+inline FlatExpr fold_constants(const FlatExpr &flat)
+{
+    constexpr uint32_t none = UINT32_MAX;
+
+    FlatExpr folded;
+    // for every input node: its index in `folded`, or none while it is a pending constant
+    std::vector<uint32_t> remap(flat.nodes.size(), none);
+    std::vector<jit_float64> constants(flat.nodes.size());
+    std::vector<bool> is_constant(flat.nodes.size(), false);
+
+    auto materialize = [&](uint32_t index) {
+        if (remap[index] == none) {
+            remap[index] = folded.push(FlatNode::number(constants[index]));
+        }
+        return remap[index];
+    };
+
+    for (size_t i = 0; i < flat.nodes.size(); i++) {
+        const FlatNode &node = flat.nodes[i];
+        switch(node.kind) {
+            case FlatNode::Kind::Number:
+                is_constant[i] = true;
+                constants[i] = node.value;
+                break;
+            case FlatNode::Kind::Identifier:
+                remap[i] = folded.push(node);
+                break;
+            case FlatNode::Kind::Unary:
+                if (is_constant[node.lhs]) {
+                    is_constant[i] = true;
+                    constants[i] = evaluate(node.unary_op(), constants[node.lhs]);
+                } else {
+                    remap[i] = folded.push(FlatNode::unary(node.unary_op(), remap[node.lhs]));
+                }
+                break;
+            case FlatNode::Kind::Binary:
+                if (is_constant[node.lhs] && is_constant[node.rhs]) {
+                    is_constant[i] = true;
+                    constants[i] = evaluate(node.binary_op(), constants[node.lhs], constants[node.rhs]);
+                } else {
+                    uint32_t lhs = materialize(node.lhs);
+                    uint32_t rhs = materialize(node.rhs);
+                    remap[i] = folded.push(FlatNode::binary(node.binary_op(), lhs, rhs));
+                }
+                break;
+        }
+    }
+    if (!flat.nodes.empty()) {
+        folded.root = materialize(flat.root);
+    }
+    return folded;
+}
+
+// Evaluates the expression in one pass over the nodes, arguments[i] is the value of slot i.
+// Interpreting costs nothing up front, so it is the cheap way to run a formula a few times.
+inline jit_float64 evaluate(const FlatExpr &flat, const jit_float64 *arguments)
+{
+    static thread_local std::vector<jit_float64> values;
+    values.resize(flat.nodes.size());
+    for (size_t i = 0; i < flat.nodes.size(); i++) {
+        const FlatNode &node = flat.nodes[i];
+        switch(node.kind) {
+            case FlatNode::Kind::Number:
+                values[i] = node.value;
+                break;
+            case FlatNode::Kind::Identifier:
+                values[i] = arguments[node.slot];
+                break;
+            case FlatNode::Kind::Unary:
+                values[i] = evaluate(node.unary_op(), values[node.lhs]);
+                break;
+            case FlatNode::Kind::Binary:
+                values[i] = evaluate(node.binary_op(), values[node.lhs], values[node.rhs]);
+                break;
+        }
+    }
+    return flat.nodes.empty() ? 0 : values[flat.root];
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cassert>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "user_function.h"
+
+// Formulas registered up front and compiled on their first call. Registering only creates the
+// libjit function and its signature; the body is generated when a call first goes through
+// libjit's redirector, which hands the function to jit-plus's on-demand compiler and from then
+// on jumps straight to the compiled code. Formulas that are never called cost no codegen.
+// The library owns the expressions, they have to outlive the functions that compile from them.
+class FormulaLibrary {
+    struct Entry {
+        const FlatExpr program;
+        PackedUserFunction function;
+
+        Entry(jit_context &context, FlatExpr program_, size_t arity):
+            program{std::move(program_)}, function(context, program, arity) {}
+    };
+
+    jit_context context;
+    // deque, entries must not move once their function refers to the program
+    std::deque<Entry> entries;
+
+    public:
+        FormulaLibrary() = default;
+        FormulaLibrary(const FormulaLibrary&) = delete;
+        FormulaLibrary &operator=(const FormulaLibrary&) = delete;
+
+        // Returns the index the formula is called by
+        size_t add(FlatExpr flat, size_t arity)
+        {
+            entries.emplace_back(context, std::move(flat), arity);
+            return entries.size() - 1;
+        }
+
+        size_t add(const ExprAST &ast, const SymbolTable &symbols)
+        {
+            return add(flatten(ast), symbols.size());
+        }
+
+        size_t size() const { return entries.size(); }
+
+        // The entry point stays the same across the on-demand compile, callers may keep it
+        PackedUserFunction::native_t entry_point(size_t index) const
+        {
+            assert(index < entries.size());
+            return entries[index].function.native();
+        }
+
+        // arguments[i] is the value of the identifier in slot i
+        jit_float64 call(size_t index, const jit_float64 *arguments) const
+        {
+            return entry_point(index)(arguments);
+        }
+
+        bool is_compiled(size_t index) const { return entries[index].function.is_compiled(); }
+
+        size_t compiled_count() const
+        {
+            size_t compiled = 0;
+            for (auto &entry: entries) {
+                compiled += entry.function.is_compiled() != 0;
+            }
+            return compiled;
+        }
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "arena.h"
+#include "parser.h"
+
+// Per-thread front of a shared SymbolTable. Lookups are answered from a local map and the shared
+// table is only locked the first time a thread sees a name, so the slots are the same on every
+// thread while the parse loop stays lock free for names it has already seen.
+class SharedSymbols {
+    SymbolTable &symbols;
+    std::mutex &lock;
+    std::unordered_map<std::string_view, uint32_t> local;
+
+    public:
+        SharedSymbols(SymbolTable &symbols, std::mutex &lock): symbols{symbols}, lock{lock} {}
+
+        uint32_t intern(std::string_view identifier)
+        {
+            auto it = local.find(identifier);
+            if (it != local.end()) {
+                return it->second;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            uint32_t slot = symbols.intern(identifier);
+            // key with the table's own copy, the input text may go away before this cache does
+            local.emplace(symbols.name(slot), slot);
+            return slot;
+        }
+};
+
+// Result of loading a newline-delimited formula file. formulas[i] is the i-th non-empty line,
+// or null if that line failed to parse. The trees live in `arenas`, one per parser thread and
+// load_formulas() call.
+struct FormulaSet {
+    struct Error {
+        size_t line;
+        std::string message;
+    };
+
+    // wall-clock seconds per phase
+    struct Timing {
+        double read = 0;
+        double split = 0;
+        double parse = 0;
+        double merge = 0;
+    };
+
+    SymbolTable symbols;
+    std::vector<ExprArena> arenas;
+    std::vector<ExprPtr> formulas;
+    std::vector<Error> errors;
+    Timing timing;
+};
+
+// Parses `text` on `threads` threads. The text is cut into chunks at line boundaries (a few per
+// thread so uneven chunks even out), the threads pull chunks from a shared counter and parse into
+// their own arena, then the per-chunk results are concatenated in file order.
+inline void load_formulas(FormulaSet &set, std::string_view text, unsigned threads)
+{
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    threads = std::max(threads, 1u);
+    auto start = clock::now();
+
+    struct Chunk {
+        std::string_view text;
+        std::vector<ExprPtr> formulas;
+        std::vector<FormulaSet::Error> errors;
+        size_t lines = 0;
+    };
+
+    size_t chunk_count = std::max<size_t>(1, std::min<size_t>(threads * 4, text.size() / 4096 + 1));
+    size_t target = text.size() / chunk_count + 1;
+    std::vector<Chunk> chunks;
+    for (size_t begin = 0; begin < text.size();) {
+        size_t end = std::min(begin + target, text.size());
+        end = text.find('\n', end);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(Chunk{text.substr(begin, end - begin), {}, {}, 0});
+        begin = end;
+    }
+    set.timing.split = seconds_since(start);
+
+    start = clock::now();
+    std::mutex symbols_lock;
+    std::atomic<size_t> next_chunk{0};
+    // every call parses into arenas of its own, formulas from earlier calls keep theirs; moving
+    // the existing arenas while the vector grows leaves their blocks in place
+    size_t first_arena = set.arenas.size();
+    set.arenas.resize(first_arena + threads);
+
+    auto worker = [&](unsigned id) {
+        SharedSymbols symbols(set.symbols, symbols_lock);
+        ArenaBuilder builder{set.arenas[first_arena + id]};
+        Parser<ArenaBuilder, SharedSymbols> parser(builder, symbols);
+
+        for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++) {
+            Chunk &chunk = chunks[c];
+            std::string_view rest = chunk.text;
+            while (!rest.empty()) {
+                size_t end = rest.find('\n');
+                std::string_view line = rest.substr(0, end);
+                rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+                chunk.lines++;
+                if (line.find_first_not_of(" \t\r") == std::string_view::npos) {
+                    continue;
+                }
+                try {
+                    chunk.formulas.push_back(parser.parse(line));
+                } catch (const ParseError &error) {
+                    chunk.formulas.push_back(nullptr);
+                    chunk.errors.push_back({chunk.lines, error.what()});
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned id = 1; id < threads; id++) {
+        pool.emplace_back(worker, id);
+    }
+    worker(0);
+    for (auto &thread: pool) {
+        thread.join();
+    }
+    set.timing.parse = seconds_since(start);
+
+    start = clock::now();
+    size_t total = set.formulas.size();
+    for (auto &chunk: chunks) {
+        total += chunk.formulas.size();
+    }
+    set.formulas.reserve(total);
+    size_t first_line = 0;
+    for (auto &chunk: chunks) {
+        for (auto &formula: chunk.formulas) {
+            set.formulas.push_back(std::move(formula));
+        }
+        for (auto &error: chunk.errors) {
+            set.errors.push_back({first_line + error.line, std::move(error.message)});
+        }
+        first_line += chunk.lines;
+    }
+    set.timing.merge = seconds_since(start);
+}
+
+// Reads and parses a formula file, see load_formulas(FormulaSet&, std::string_view, unsigned)
+inline bool load_formula_file(FormulaSet &set, const std::string &path,
+                              unsigned threads = std::thread::hardware_concurrency())
+{
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    std::string text = contents.str();
+    set.timing.read = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // identifiers are copied into the symbol table, trees do not refer to the text
+    load_formulas(set, text, threads);
+    return true;
+}
@@ -1,236 +1,182 @@
-#include <memory>
+#include <cstdio>
 #include <cassert>
 #include <vector>
-#include <string>
-#include <algorithm>
-#include <unordered_map>
+#include <thread>
 
 #include <jit/jit-plus.h>
 
-// forward declaration for Visitor
-struct BinaryExprAST;
-struct UnaryExprAST;
-struct NumberExprAST;
-struct IdentifierExprAST;
-
-// visitor interface
-class Visitor {
-    public:
-        virtual void visit_binary_node(const BinaryExprAST *node) = 0;
-        virtual void visit_unary_node(const UnaryExprAST *node) = 0;
-        virtual void visit_number_node(const NumberExprAST *node) = 0;
-        virtual void visit_identifier_node(const IdentifierExprAST *node) = 0;
-};
-
-// AST nodes
-struct ExprAST {
-    virtual ~ExprAST() = default;
-    virtual void accept(Visitor *visitor) const = 0;
-};
-
-// AST node for raw values, only double is supported
-struct NumberExprAST: public ExprAST {
-    const jit_float64 value;
-
-    explicit NumberExprAST(jit_float64 value): value{value} {}
-    void accept(Visitor *visitor) const override { visitor->visit_number_node(this); }
-};
-
-// AST node for identifier
-struct IdentifierExprAST: public ExprAST {
-    const std::string &identifier;
-    explicit IdentifierExprAST(const std::string &id): identifier{id} {}
-    void accept(Visitor *visitor) const override { visitor->visit_identifier_node(this); }
-};
-
-enum class BinaryOperator {
-    Plus,
-    Minus,
-    Mult,
-    Div,
-};
-
-// AST node that represents binary operations listed in BinaryOperator enum
-struct BinaryExprAST: public ExprAST {
-    const BinaryOperator op;
-    const std::unique_ptr<ExprAST> lhs, rhs;
-    BinaryExprAST(BinaryOperator op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs):
-        op{op}, lhs{std::move(lhs)}, rhs{std::move(rhs)} {}
-    void accept(Visitor *visit) const override { visit->visit_binary_node(this); }
-};
-
-enum class UnaryOperator {
-    Acos,
-    Asin,
-    Atan,
-    Cos,
-    Cosh,
-    Exp,
-    Log10,
-    Sin,
-    Sinh,
-    Sqrt,
-    Tan,
-    Tanh,
-};
-
-// AST node that represents unary operations listed in UnaryOperator enum
-struct UnaryExprAST: public ExprAST {
-    UnaryOperator op;
-    std::unique_ptr<ExprAST> arg;
-
-    UnaryExprAST(UnaryOperator op, std::unique_ptr<ExprAST> arg):
-        op{op}, arg{std::move(arg)} {}
-    void accept(Visitor *visit) const override { visit->visit_unary_node(this); }
-};
-
-//Visitor implementations for codegen and AST analysis
-class UserFunction: public jit_function, public Visitor {
-    const ExprAST &ast;
-    const std::vector<std::string> &identifiers;
-    jit_value current_result;
-
-    public:
-        UserFunction(jit_context &context, ExprAST const &ast, const std::vector<std::string> &identifiers):
-            jit_function(context), ast{ast}, identifiers{identifiers}
-        {
-            create();
-        }
-
-        jit_type_t create_signature() override
-        {
-            std::vector<jit_type_t> params(identifiers.size(), jit_type_float64);
-            return jit_type_create_signature(jit_abi_cdecl, jit_type_float64, params.data(), params.size(), 1);
-        }
-
-        void build() override
-        {
-            ast.accept(this);
-            insn_return(current_result);
-        }
-
-        jit_float64 call(std::vector<jit_float64> arguments)
-        {
-            jit_float64 result;
-            std::vector<void*> _args(arguments.size());
-            std::transform(arguments.begin(), arguments.end(), _args.begin(), [](auto &i) { return &i; });
-
-            apply(_args.data(), &result);
-
-            return result;
-        }
-
-        void visit_binary_node(const BinaryExprAST *node) override
-        {
-            node->lhs->accept(this);
-            jit_value tmp_left = current_result;
-            node->rhs->accept(this);
-            jit_value tmp_right = current_result;
-
-            switch(node->op) {
-                case BinaryOperator::Plus:
-                    current_result = insn_add(tmp_left, tmp_right);
-                    break;
-                case BinaryOperator::Mult:
-                    current_result = insn_mul(tmp_left, tmp_right);
-                    break;
-                case BinaryOperator::Minus:
-                    current_result = insn_sub(tmp_left, tmp_right);
-                    break;
-                case BinaryOperator::Div:
-                    current_result = insn_div(tmp_left, tmp_right);
-                    break;
-            }
-        }
-
-        void visit_unary_node(const UnaryExprAST *node) override
-        {
-            node->arg->accept(this);
-            jit_value tmp = current_result;
-
-            switch(node->op) {
-                case UnaryOperator::Acos:
-                    current_result = insn_acos(tmp);
-                    break;
-                case UnaryOperator::Asin:
-                    current_result = insn_asin(tmp);
-                    break;
-                case UnaryOperator::Atan:
-                    current_result = insn_atan(tmp);
-                    break;
-                case UnaryOperator::Cos:
-                    current_result = insn_cos(tmp);
-                    break;
-                case UnaryOperator::Cosh:
-                    current_result = insn_cosh(tmp);
-                    break;
-                case UnaryOperator::Exp:
-                    current_result = insn_exp(tmp);
-                    break;
-                case UnaryOperator::Log10:
-                    current_result = insn_log10(tmp);
-                    break;
-                case UnaryOperator::Sin:
-                    current_result = insn_sin(tmp);
-                    break;
-                case UnaryOperator::Sinh:
-                    current_result = insn_sinh(tmp);
-                    break;
-                case UnaryOperator::Sqrt:
-                    current_result = insn_sqrt(tmp);
-                    break;
-                case UnaryOperator::Tan:
-                    current_result = insn_tan(tmp);
-                    break;
-                case UnaryOperator::Tanh:
-                    current_result = insn_tanh(tmp);
-                    break;
-            }
-        }
-
-        void visit_number_node(const NumberExprAST *node) override
-        {
-            current_result = new_constant(node->value, jit_type_float64);
-        }
-
-        void visit_identifier_node(const IdentifierExprAST *node) override
-        {
-            auto it = std::find(identifiers.cbegin(), identifiers.cend(), node->identifier);
-            current_result = get_param(std::distance(identifiers.cbegin(), it));
-        }
-};
-
-//
-// Helper functions to make this look more concise, one could also use operator overload
-//
-
-std::unique_ptr<NumberExprAST> Number(double val)
-{
-    return std::make_unique<NumberExprAST>(static_cast<jit_float64>(val));
-}
-
-std::unique_ptr<IdentifierExprAST> Identifier(const std::string &identifier) {
-    return std::make_unique<IdentifierExprAST>(identifier);
-}
-
-std::unique_ptr<BinaryExprAST> Mult(std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs)
-{
-    return std::make_unique<BinaryExprAST>(BinaryOperator::Mult, std::move(lhs), std::move(rhs));
-}
-
-std::unique_ptr<BinaryExprAST> Add(std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs)
-{
-    return std::make_unique<BinaryExprAST>(BinaryOperator::Plus, std::move(lhs), std::move(rhs));
-}
+#include "ast.h"
+#include "user_function.h"
+#include "constant_folding.h"
+#include "flat.h"
+#include "dag.h"
+#include "parser.h"
+#include "thread_pool.h"
+#include "compile_cache.h"
+#include "context_pool.h"
+#include "compile_service.h"
+#include "compile_async.h"
+#include "tiered.h"
+#include "bytecode.h"
+#include "adaptive.h"
+#include "library.h"
+#include "rewrite.h"
+#include "egraph.h"
+#include "reassociate.h"
 
 int main()
 {
-    auto ast = Add(Mult(Number(1), Number(2)), Mult(Identifier("y"), Identifier("x")));
-    std::vector<std::string> identifiers({"x", "y"});
+    // interning x and y up front fixes the parameter order to f(x, y)
+    SymbolTable symbols({"x", "y"});
+    auto ast = Add(Mult(Number(1), Number(2)), Mult(Identifier(symbols, "y"), Identifier(symbols, "x")));
+    // Mult(Number(1), Number(2)) becomes Number(2) before codegen
+    auto folded = fold_constants(*ast);
 
     jit_context context;
 
-    UserFunction f(context, *ast, identifiers);
+    UserFunction f(context, *folded, symbols);
     std::vector<double> args({3, 5});
     printf("Result: %lf\n", f.call(args));
+
+    auto native = f.compiled<2>();
+    printf("Native result: %lf\n", native(3, 5));
+
+    PackedUserFunction packed(context, *ast, symbols);
+    ArgumentBlock block(packed.argument_layout());
+    block.set(0, 3);
+    block.set(1, 5);
+    printf("Packed result: %lf\n", packed.call(block));
+
+    std::vector<double> xs({3, 1, 2}), ys({5, 4, 0});
+    const double *cols[] = {xs.data(), ys.data()};
+    std::vector<double> out(xs.size());
+    f.eval_batch(cols, out.data(), out.size());
+    for (auto r: out) {
+        printf("Batch result: %lf\n", r);
+    }
+
+    WorkStealingPool pool(4);
+    std::vector<double> many_xs(1 << 20, 3), many_ys(1 << 20, 5), many_out(1 << 20);
+    const double *many_cols[] = {many_xs.data(), many_ys.data()};
+    f.eval_batch_parallel(pool, many_cols, many_out.data(), many_out.size());
+    printf("Parallel batch result: %lf\n", many_out.back());
+
+    // sin(x*y) is emitted once and reused by both operands of the sum
+    auto repeated = Add(std::make_unique<UnaryExprAST>(UnaryOperator::Sin, Mult(Identifier(symbols, "x"), Identifier(symbols, "y"))),
+                        std::make_unique<UnaryExprAST>(UnaryOperator::Sin, Mult(Identifier(symbols, "x"), Identifier(symbols, "y"))));
+    FlatExpr dag = build_dag(*repeated);
+    UserFunction shared(context, dag, symbols);
+    printf("DAG result (%zu nodes): %lf\n", dag.nodes.size(), shared.compiled<2>()(3, 5));
+
+    // formulas can also be parsed from text, new identifiers get the next free slots
+    SymbolTable parsed_symbols;
+    auto parsed = parse("2*sin(x)+y/z", parsed_symbols);
+    UserFunction from_text(context, *parsed, parsed_symbols);
+    printf("Parsed result: %lf\n", from_text.compiled<3>()(1, 4, 2));
+
+    // the second lookup is answered from the cache, the AST is equal but separately allocated
+    CompileCache cache(1 << 20);
+    auto cached = cache.get(*ast, symbols);
+    auto same_ast = Add(Mult(Number(1), Number(2)), Mult(Identifier(symbols, "y"), Identifier(symbols, "x")));
+    auto cached_again = cache.get(*same_ast, symbols);
+    printf("Cached result: %lf\n", cached_again->function.compiled<2>()(3, 5));
+    auto stats = cache.stats();
+    printf("Cache: %zu hits, %zu misses, %zu bytes\n", stats.hits, stats.misses, stats.code_bytes);
+    assert(cached == cached_again);
+
+    // each thread compiles into its own context, the results are callable from any thread
+    ContextPool contexts;
+    std::unique_ptr<UserFunction> compiled_on_thread;
+    std::thread compiler([&] { compiled_on_thread = contexts.compile(*parsed, parsed_symbols); });
+    auto compiled_here = contexts.compile(*ast, symbols);
+    compiler.join();
+    printf("Context pool results (%zu contexts): %lf %lf\n", contexts.size(),
+           compiled_on_thread->compiled<3>()(1, 4, 2), compiled_here->compiled<2>()(3, 5));
+
+    // eight threads ask for the same new formula at once, it is compiled a single time
+    CompileService service;
+    std::vector<std::thread> requests;
+    for (int i = 0; i < 8; i++) {
+        requests.emplace_back([&] { service.get(*parsed, parsed_symbols); });
+    }
+    for (auto &request: requests) {
+        request.join();
+    }
+    auto service_stats = service.stats();
+    printf("Compile service: %zu requests, %zu compiles, %zu waited %lf s\n", service_stats.requests,
+           service_stats.compiles, service_stats.waits, service_stats.wait_seconds);
+
+    // the request thread only polls, the compile runs on the pool
+    AsyncCompiler async_compiler(pool);
+    auto handle = async_compiler.compile_async(*parsed, parsed_symbols);
+    handle.then([](const CompileHandle &done) {
+        printf("Async result: %lf\n", done.get()->function.compiled<3>()(1, 4, 2));
+    });
+    while (!handle.ready()) {
+        std::this_thread::yield();
+    }
+
+    std::vector<double> tiered_args({1, 4, 2});
+    Bytecode bytecode(*parsed);
+    printf("Bytecode result (%zu instructions): %lf\n", bytecode.size(), bytecode(tiered_args.data()));
+
+    // interpreted for the first 16 calls, native once the background compile is done
+    TieredExecutor executor(pool, 16);
+    auto tiered = executor.make(*parsed, parsed_symbols);
+    double tiered_result = 0;
+    for (int i = 0; i < 1000; i++) {
+        tiered_result = (*tiered)(tiered_args);
+    }
+    printf("Tiered result: %lf (%zu interpreted calls, native: %d)\n", tiered_result, tiered->interpreted_calls(),
+           tiered->is_native());
+
+    // compiled cheaply first, recompiled at the highest level after 100 calls
+    AdaptiveFunction adaptive(pool, context, *parsed, parsed_symbols, 100);
+    double adaptive_result = 0;
+    for (int i = 0; i < 1000; i++) {
+        adaptive_result = adaptive(tiered_args);
+    }
+    printf("Adaptive result: %lf (%zu calls counted, optimised: %d)\n", adaptive_result, adaptive.call_count(),
+           adaptive.is_optimized());
+
+    // registered formulas are compiled when they are first called, the second one never is
+    FormulaLibrary library;
+    size_t first = library.add(*parsed, parsed_symbols);
+    library.add(*repeated, parsed_symbols);
+    printf("Library result: %lf (%zu of %zu compiled)\n", library.call(first, tiered_args.data()),
+           library.compiled_count(), library.size());
+
+    // x*1 and y/4 are rewritten without changing results, exp(x)*exp(y) only with fast-math
+    auto redundant = parse("exp(x)*exp(y) + x*1 + y/4", parsed_symbols);
+    auto rules = standard_rules();
+    Rewriter rewriter(rules, RewriteMode::FastMath);
+    auto simplified = rewriter.rewrite(*redundant);
+    UserFunction simplified_function(context, *simplified, parsed_symbols);
+    printf("Simplified result: %lf\n", simplified_function.compiled<3>()(1, 4, 2));
+    for (auto &rule: rewriter.stats()) {
+        if (rule.applied) {
+            printf("  %s applied %zu times, %ld nodes removed\n", rule.rule.c_str(), rule.applied, rule.nodes_removed);
+        }
+    }
+
+    // the e-graph keeps every rewritten form, x*y + x*z only gets factored with fast-math
+    auto factorable = parse("x*y + x*z + x/2", parsed_symbols);
+    auto egraph_rule_set = egraph_rules();
+    EGraphOptimizer optimizer(egraph_rule_set, RewriteMode::FastMath);
+    auto optimized = optimizer.optimize(*factorable);
+    UserFunction optimized_function(context, *optimized, parsed_symbols);
+    auto &egraph_report = optimizer.report();
+    printf("E-graph result: %lf (%zu nodes, estimated %.0f -> %.0f cycles)\n", optimized_function.compiled<3>()(1, 4, 2),
+           egraph_report.nodes, egraph_report.cost_before, egraph_report.cost_after);
+
+    // ((x+y)+z)+x becomes (x+y)+(z+x), two additions can run at the same time
+    auto chain = parse("x + y + z + x", parsed_symbols);
+    auto balanced = reassociate(*chain);
+    UserFunction balanced_function(context, *balanced, parsed_symbols);
+    printf("Reassociated result: %lf\n", balanced_function.compiled<3>()(1, 4, 2));
+
+    // x^13 is five multiplications, y^0.5 a square root, only x^y calls pow
+    auto polynomial = parse("x^13 - 3*x^2 + y^0.5 + x^y", parsed_symbols);
+    UserFunction polynomial_function(context, *polynomial, parsed_symbols);
+    printf("Power result: %lf\n", polynomial_function.compiled<3>()(1, 4, 2));
 }
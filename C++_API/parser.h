@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <charconv>
+#include <cstdint>
+
+#include "ast.h"
+#include "arena.h"
+#include "flat.h"
+
+// Thrown for malformed input, position is the byte offset into the parsed string
+struct ParseError: public std::runtime_error {
+    const size_t position;
+    ParseError(const std::string &message, size_t position):
+        std::runtime_error(message + " at offset " + std::to_string(position)), position{position} {}
+};
+
+//
+// Node builders the parser emits into. Each one creates nodes of its own node_type, so the same
+// parser produces heap trees, arena trees or the flat form without an intermediate copy.
+//
+
+struct HeapBuilder {
+    using node_type = ExprPtr;
+
+    node_type number(jit_float64 value) { return Number(value); }
+    node_type identifier(uint32_t slot) { return std::make_unique<IdentifierExprAST>(slot); }
+    node_type unary(UnaryOperator op, node_type arg) { return std::make_unique<UnaryExprAST>(op, std::move(arg)); }
+    node_type binary(BinaryOperator op, node_type lhs, node_type rhs)
+    {
+        return std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+    }
+};
+
+struct ArenaBuilder {
+    using node_type = ExprPtr;
+    ExprArena &arena;
+
+    node_type number(jit_float64 value) { return arena.number(value); }
+    node_type identifier(uint32_t slot) { return arena.make<IdentifierExprAST>(slot); }
+    node_type unary(UnaryOperator op, node_type arg) { return arena.unary(op, std::move(arg)); }
+    node_type binary(BinaryOperator op, node_type lhs, node_type rhs)
+    {
+        return arena.binary(op, std::move(lhs), std::move(rhs));
+    }
+};
+
+// Appends to a FlatExpr, the parser produces nodes in post-order so no reordering is needed
+struct FlatBuilder {
+    using node_type = uint32_t;
+    FlatExpr &flat;
+
+    node_type number(jit_float64 value) { return flat.push(FlatNode::number(value)); }
+    node_type identifier(uint32_t slot) { return flat.push(FlatNode::identifier(slot)); }
+    node_type unary(UnaryOperator op, node_type arg) { return flat.push(FlatNode::unary(op, arg)); }
+    node_type binary(BinaryOperator op, node_type lhs, node_type rhs)
+    {
+        return flat.push(FlatNode::binary(op, lhs, rhs));
+    }
+};
+
+// Pratt parser for formulas like `2*sin(x)+y/z`.
+//
+// Grammar: numbers (anything std::from_chars accepts, starting with a digit or '.'), identifiers,
+// parentheses, the binary operators + - * / with the usual precedence and left associativity,
+// ^ for powers, right associative and binding tighter than prefix minus (-x^2 is -(x^2)),
+// prefix minus, calls of the UnaryOperator functions (acos, asin, ..., tanh), and pow(x, y).
+// Tokens are views into the input, identifiers are interned straight from those views.
+// Symbols is anything with SymbolTable's intern(std::string_view).
+// Nesting deeper than max_depth and trees taller than max_height throw a ParseError.
+template <typename Builder, typename Symbols = SymbolTable>
+class Parser {
+    using node_type = typename Builder::node_type;
+
+    Builder &builder;
+    Symbols &symbols;
+    std::string_view input;
+    size_t pos = 0;
+    // parse_expression() calls in progress
+    int depth = 0;
+    // height of the tree of the node parsed last, leaves are 1
+    int height = 0;
+
+    // deeper nesting is rejected instead of overflowing the stack in the parser
+    static constexpr int max_depth = 256;
+    // taller trees are rejected instead of overflowing the stack in the recursive passes that
+    // walk the tree later (flatten(), the visitors, the node destructors); a chain of n binary
+    // operators is n high, so this also bounds sums and products to 4095 operators
+    static constexpr int max_height = 4096;
+
+    // the node built last has a child of child_height
+    void set_height(int child_height)
+    {
+        height = child_height + 1;
+        if (height > max_height) {
+            throw ParseError("expression too deep", pos);
+        }
+    }
+
+    // binding power of prefix minus, above every binary operator but ^
+    static constexpr int prefix_power = 25;
+    static constexpr int pow_power = 30;
+
+    static bool is_identifier_start(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static bool is_identifier_char(char c)
+    {
+        return is_identifier_start(c) || (c >= '0' && c <= '9');
+    }
+
+    static bool is_number_start(char c)
+    {
+        return (c >= '0' && c <= '9') || c == '.';
+    }
+
+    static bool lookup_function(std::string_view name, UnaryOperator &op)
+    {
+        static constexpr std::pair<std::string_view, UnaryOperator> functions[] = {
+            {"acos", UnaryOperator::Acos},
+            {"asin", UnaryOperator::Asin},
+            {"atan", UnaryOperator::Atan},
+            {"cos", UnaryOperator::Cos},
+            {"cosh", UnaryOperator::Cosh},
+            {"exp", UnaryOperator::Exp},
+            {"log10", UnaryOperator::Log10},
+            {"sin", UnaryOperator::Sin},
+            {"sinh", UnaryOperator::Sinh},
+            {"sqrt", UnaryOperator::Sqrt},
+            {"tan", UnaryOperator::Tan},
+            {"tanh", UnaryOperator::Tanh},
+        };
+        for (auto &function: functions) {
+            if (function.first == name) {
+                op = function.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // left binding power of a binary operator, 0 if c does not start one
+    static int infix_power(char c, BinaryOperator &op)
+    {
+        switch(c) {
+            case '+':
+                op = BinaryOperator::Plus;
+                return 10;
+            case '-':
+                op = BinaryOperator::Minus;
+                return 10;
+            case '*':
+                op = BinaryOperator::Mult;
+                return 20;
+            case '/':
+                op = BinaryOperator::Div;
+                return 20;
+            case '^':
+                op = BinaryOperator::Pow;
+                return pow_power;
+        }
+        return 0;
+    }
+
+    void skip_whitespace()
+    {
+        while (pos < input.size() && (input[pos] == ' ' || input[pos] == '\t' || input[pos] == '\r' || input[pos] == '\n')) {
+            pos++;
+        }
+    }
+
+    char peek()
+    {
+        skip_whitespace();
+        return pos < input.size() ? input[pos] : '\0';
+    }
+
+    void expect(char c)
+    {
+        if (peek() != c) {
+            throw ParseError(std::string("expected '") + c + "'", pos);
+        }
+        pos++;
+    }
+
+    jit_float64 parse_number()
+    {
+        jit_float64 value;
+        auto result = std::from_chars(input.data() + pos, input.data() + input.size(), value);
+        if (result.ec != std::errc()) {
+            throw ParseError("malformed number", pos);
+        }
+        pos = result.ptr - input.data();
+        return value;
+    }
+
+    node_type parse_prefix()
+    {
+        char c = peek();
+        if (is_number_start(c)) {
+            height = 1;
+            return builder.number(parse_number());
+        }
+        if (is_identifier_start(c)) {
+            size_t start = pos;
+            while (pos < input.size() && is_identifier_char(input[pos])) {
+                pos++;
+            }
+            std::string_view name = input.substr(start, pos - start);
+            UnaryOperator op = UnaryOperator::Acos;
+            if (peek() == '(' && name == "pow") {
+                pos++;
+                node_type base = parse_expression(0);
+                int base_height = height;
+                expect(',');
+                node_type exponent = parse_expression(0);
+                expect(')');
+                set_height(std::max(base_height, height));
+                return builder.binary(BinaryOperator::Pow, std::move(base), std::move(exponent));
+            }
+            if (peek() == '(' && lookup_function(name, op)) {
+                pos++;
+                node_type arg = parse_expression(0);
+                expect(')');
+                set_height(height);
+                return builder.unary(op, std::move(arg));
+            }
+            height = 1;
+            return builder.identifier(symbols.intern(name));
+        }
+        if (c == '(') {
+            pos++;
+            node_type inner = parse_expression(0);
+            expect(')');
+            return inner;
+        }
+        if (c == '-') {
+            pos++;
+            // literals are negated directly, unless a power follows (-2^2 is -4), everything else
+            // becomes -1 * operand
+            if (is_number_start(peek())) {
+                size_t start = pos;
+                jit_float64 value = parse_number();
+                if (peek() != '^') {
+                    height = 1;
+                    return builder.number(-value);
+                }
+                pos = start;
+            }
+            node_type operand = parse_expression(prefix_power);
+            set_height(height);
+            return builder.binary(BinaryOperator::Mult, builder.number(-1), std::move(operand));
+        }
+        if (c == '\0') {
+            throw ParseError("unexpected end of input", pos);
+        }
+        throw ParseError(std::string("unexpected '") + c + "'", pos);
+    }
+
+    // parentheses, function arguments, prefix minus and the right operands of binary operators
+    // each nest one level deeper
+    node_type parse_expression(int min_power)
+    {
+        if (++depth > max_depth) {
+            throw ParseError("expression nested too deeply", pos);
+        }
+        node_type lhs = parse_prefix();
+        for (;;) {
+            int lhs_height = height;
+            BinaryOperator op = BinaryOperator::Plus;
+            int power = infix_power(peek(), op);
+            if (power <= min_power) {
+                depth--;
+                return lhs;
+            }
+            pos++;
+            // left associative: the right operand only takes operators that bind tighter,
+            // except ^, which is right associative: 2^3^2 is 2^(3^2)
+            node_type rhs = parse_expression(op == BinaryOperator::Pow ? power - 1 : power);
+            set_height(std::max(lhs_height, height));
+            lhs = builder.binary(op, std::move(lhs), std::move(rhs));
+        }
+    }
+
+    public:
+        Parser(Builder &builder, Symbols &symbols): builder{builder}, symbols{symbols} {}
+
+        node_type parse(std::string_view text)
+        {
+            input = text;
+            pos = 0;
+            depth = 0;
+            node_type result = parse_expression(0);
+            if (peek() != '\0') {
+                throw ParseError(std::string("unexpected '") + input[pos] + "'", pos);
+            }
+            return result;
+        }
+};
+
+inline ExprPtr parse(std::string_view text, SymbolTable &symbols)
+{
+    HeapBuilder builder;
+    return Parser<HeapBuilder>(builder, symbols).parse(text);
+}
+
+inline ExprPtr parse(std::string_view text, SymbolTable &symbols, ExprArena &arena)
+{
+    ArenaBuilder builder{arena};
+    return Parser<ArenaBuilder>(builder, symbols).parse(text);
+}
+
+inline FlatExpr parse_flat(std::string_view text, SymbolTable &symbols)
+{
+    FlatExpr flat;
+    FlatBuilder builder{flat};
+    flat.root = Parser<FlatBuilder>(builder, symbols).parse(text);
+    return flat;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <jit/jit.h>
+
+// Exponentiation without libm pow, for exponents that are small multiples of 1/4 or 1/3.
+// base^|exponent| is split into base^whole, computed by an addition chain, times base^fraction,
+// computed by square and cube roots, and a negative exponent divides 1 by the result. Codegen,
+// the interpreters and constant folding all go through expand_power(), so they compute the same
+// bits. The results may differ from std::pow by a few ulp, x^0.5 is sqrt(x) (-0 for -0, NaN
+// for -inf), and x^(1/3) is the real cube root, also of negative x.
+
+// larger exponents go to std::pow: every squaring doubles the relative error, x^32 by
+// multiplication is already up to ~16 ulp off
+constexpr uint32_t max_chain_exponent = 32;
+// longest chain up to max_chain_exponent, 31 needs 7 steps
+constexpr size_t max_chain_steps = 7;
+
+// Shortest addition chain for n, as steps: step i computes element i + 1 of the chain as
+// element first + element second, element 0 is the base itself. x^13 takes five steps,
+// for example x2 = x*x, x4 = x2*x2, x8 = x4*x4, x12 = x8*x4, x13 = x12*x.
+inline const std::vector<std::pair<uint8_t, uint8_t>> &addition_chain(uint32_t n)
+{
+    using Chain = std::vector<std::pair<uint8_t, uint8_t>>;
+
+    // Iterative deepening over star chains (every element adds to the one before it), which
+    // are the shortest chains for every n this small
+    struct Search {
+        const uint32_t n;
+        const size_t length;
+        std::vector<uint32_t> elements{1};
+        Chain steps;
+
+        Search(uint32_t n, size_t length): n{n}, length{length} {}
+
+        bool extend()
+        {
+            uint32_t last = elements.back();
+            if (last == n) {
+                return true;
+            }
+            size_t remaining = length - steps.size();
+            // doubling every remaining step is the fastest growth possible
+            if (remaining == 0 || (static_cast<uint64_t>(last) << remaining) < n) {
+                return false;
+            }
+            for (size_t i = elements.size(); i-- > 0;) {
+                if (last + elements[i] > n) {
+                    continue;
+                }
+                elements.push_back(last + elements[i]);
+                steps.emplace_back(elements.size() - 2, i);
+                if (extend()) {
+                    return true;
+                }
+                elements.pop_back();
+                steps.pop_back();
+            }
+            return false;
+        }
+    };
+
+    static const std::vector<Chain> chains = [] {
+        std::vector<Chain> chains(max_chain_exponent + 1);
+        for (uint32_t n = 2; n <= max_chain_exponent; n++) {
+            for (size_t length = 1;; length++) {
+                Search search(n, length);
+                if (search.extend()) {
+                    assert(search.steps.size() <= max_chain_steps);
+                    chains[n] = std::move(search.steps);
+                    break;
+                }
+            }
+        }
+        return chains;
+    }();
+    assert(n <= max_chain_exponent);
+    return chains[n];
+}
+
+struct PowerPlan {
+    enum class Root {
+        None,
+        Quarter,
+        Third,
+        Half,
+        TwoThirds,
+        ThreeQuarters,
+    };
+
+    uint32_t whole = 0;
+    Root root = Root::None;
+    bool reciprocal = false;
+};
+
+// False if the exponent needs std::pow
+inline bool plan_power(jit_float64 exponent, PowerPlan &plan)
+{
+    jit_float64 magnitude = std::fabs(exponent);
+    // also false for NaN
+    if (!(magnitude <= max_chain_exponent)) {
+        return false;
+    }
+    plan.whole = static_cast<uint32_t>(magnitude);
+    plan.reciprocal = exponent < 0;
+    jit_float64 fraction = magnitude - plan.whole;
+    if (fraction == 0) {
+        plan.root = PowerPlan::Root::None;
+    } else if (fraction == 0.25) {
+        plan.root = PowerPlan::Root::Quarter;
+    } else if (fraction == 0.5) {
+        plan.root = PowerPlan::Root::Half;
+    } else if (fraction == 0.75) {
+        plan.root = PowerPlan::Root::ThreeQuarters;
+    } else if (magnitude == (3 * plan.whole + 1) / 3.0) {
+        // only the double nearest to whole + 1/3 counts
+        plan.root = PowerPlan::Root::Third;
+    } else if (magnitude == (3 * plan.whole + 2) / 3.0) {
+        plan.root = PowerPlan::Root::TwoThirds;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Computes base^exponent following the plan. Ops provides mult(a, b), div(a, b), sqrt(a),
+// cbrt(a) and one() on Values, which are numbers, jit_values or registers.
+template <typename Value, typename Ops>
+Value expand_power(Ops &ops, const Value &base, const PowerPlan &plan)
+{
+    // no heap allocation, power() runs this for every call with a variable exponent
+    Value chain[max_chain_steps + 1];
+    Value factors[2];
+    size_t factor_count = 0;
+    if (plan.whole > 0) {
+        auto &steps = addition_chain(plan.whole);
+        chain[0] = base;
+        for (size_t i = 0; i < steps.size(); i++) {
+            chain[i + 1] = ops.mult(chain[steps[i].first], chain[steps[i].second]);
+        }
+        factors[factor_count++] = chain[steps.size()];
+    }
+    switch(plan.root) {
+        case PowerPlan::Root::None:
+            break;
+        case PowerPlan::Root::Quarter:
+            factors[factor_count++] = ops.sqrt(ops.sqrt(base));
+            break;
+        case PowerPlan::Root::Half:
+            factors[factor_count++] = ops.sqrt(base);
+            break;
+        case PowerPlan::Root::ThreeQuarters: {
+            Value root = ops.sqrt(base);
+            factors[factor_count++] = ops.mult(root, ops.sqrt(root));
+            break;
+        }
+        case PowerPlan::Root::Third:
+            factors[factor_count++] = ops.cbrt(base);
+            break;
+        case PowerPlan::Root::TwoThirds: {
+            Value root = ops.cbrt(base);
+            factors[factor_count++] = ops.mult(root, root);
+            break;
+        }
+    }
+
+    Value result = factor_count == 0 ? ops.one() : factors[0];
+    if (factor_count == 2) {
+        result = ops.mult(factors[0], factors[1]);
+    }
+    return plan.reciprocal ? ops.div(ops.one(), result) : result;
+}
+
+// base^exponent as the generated code computes it
+inline jit_float64 power(jit_float64 base, jit_float64 exponent)
+{
+    struct NumberOps {
+        jit_float64 mult(jit_float64 a, jit_float64 b) { return a * b; }
+        jit_float64 div(jit_float64 a, jit_float64 b) { return a / b; }
+        jit_float64 sqrt(jit_float64 a) { return std::sqrt(a); }
+        jit_float64 cbrt(jit_float64 a) { return std::cbrt(a); }
+        jit_float64 one() { return 1; }
+    };
+
+    PowerPlan plan;
+    if (!plan_power(exponent, plan)) {
+        return std::pow(base, exponent);
+    }
+    NumberOps ops;
+    return expand_power(ops, base, plan);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ast.h"
+
+// Reassociation: the parser turns a+b+c+d into ((a+b)+c)+d, a chain of dependent additions the
+// CPU has to execute one after another. This pass rebuilds every chain of Plus or of Mult nodes
+// as a balanced tree, (a+b)+(c+d), so a chain of n operands takes log2(n) dependent operations
+// and the rest can run in parallel. Operands keep their left-to-right order.
+//
+// Floating point addition and multiplication are not associative, so results may differ in the
+// last bits, and intermediate overflow may come and go. Only use it where fast-math is acceptable.
+class Reassociator: public Visitor {
+    std::unique_ptr<ExprAST> current_result;
+    size_t rebalanced = 0;
+
+    // operands of the chain of op nodes rooted at node, rewritten, in left-to-right order
+    void collect(const ExprAST &node, BinaryOperator op, std::vector<std::unique_ptr<ExprAST>> &operands)
+    {
+        auto binary = dynamic_cast<const BinaryExprAST*>(&node);
+        if (binary && binary->op == op) {
+            collect(*binary->lhs, op, operands);
+            collect(*binary->rhs, op, operands);
+        } else {
+            operands.push_back(reassociate(node));
+        }
+    }
+
+    static std::unique_ptr<ExprAST> balance(BinaryOperator op, std::vector<std::unique_ptr<ExprAST>> &operands,
+                                            size_t begin, size_t end)
+    {
+        if (end - begin == 1) {
+            return std::move(operands[begin]);
+        }
+        size_t middle = begin + (end - begin) / 2;
+        auto lhs = balance(op, operands, begin, middle);
+        auto rhs = balance(op, operands, middle, end);
+        return std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+    }
+
+    public:
+        std::unique_ptr<ExprAST> reassociate(const ExprAST &ast)
+        {
+            ast.accept(this);
+            return std::move(current_result);
+        }
+
+        // number of chains of three or more operands that were rebuilt
+        size_t rebalanced_count() const { return rebalanced; }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            if (node->op != BinaryOperator::Plus && node->op != BinaryOperator::Mult) {
+                auto lhs = reassociate(*node->lhs);
+                auto rhs = reassociate(*node->rhs);
+                current_result = std::make_unique<BinaryExprAST>(node->op, std::move(lhs), std::move(rhs));
+                return;
+            }
+            std::vector<std::unique_ptr<ExprAST>> operands;
+            collect(*node, node->op, operands);
+            rebalanced += operands.size() > 2;
+            current_result = balance(node->op, operands, 0, operands.size());
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            current_result = std::make_unique<UnaryExprAST>(node->op, reassociate(*node->arg));
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = std::make_unique<NumberExprAST>(node->value);
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = std::make_unique<IdentifierExprAST>(node->slot);
+        }
+};
+
+inline std::unique_ptr<ExprAST> reassociate(const ExprAST &ast)
+{
+    return Reassociator().reassociate(ast);
+}
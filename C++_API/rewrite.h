@@ -0,0 +1,346 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast.h"
+#include "ast_util.h"
+#include "flat.h"
+#include "parser.h"
+
+class RewriteMatch;
+
+// A rewrite rule written in the formula syntax, for example ("x*1", "x"). Identifiers in the
+// pattern are variables: they match any subtree, except variables named c, c1, c2, ... which only
+// match numbers, and a variable used more than once only matches equal subtrees. Numbers match
+// bitwise, so 0 does not match -0. The replacement may use the pattern's variables; operators
+// in it whose operands end up being numbers are evaluated right away, so "x*(1/c)" puts a single
+// constant into the tree.
+struct RewriteRule {
+    using Guard = std::function<bool(const RewriteMatch&)>;
+
+    std::string name;
+    std::vector<std::string> variables;
+    // per variable, true if it only matches numbers
+    std::vector<bool> constant_only;
+    FlatExpr pattern;
+    FlatExpr replacement;
+    // true if the replacement computes bit-identical results for every input
+    bool exact;
+    // extra condition on the matched subtrees, may be empty
+    Guard guard;
+};
+
+// Subtrees bound by a successful match, looked up by variable name. The e-graph optimiser only
+// binds the constant variables (c, c1, ...), asking it for another variable throws.
+class RewriteMatch {
+    const RewriteRule &rule;
+    const std::vector<const ExprAST*> &bound;
+
+    public:
+        RewriteMatch(const RewriteRule &rule, const std::vector<const ExprAST*> &bound): rule{rule}, bound{bound} {}
+
+        const ExprAST &operator[](std::string_view variable) const
+        {
+            for (size_t i = 0; i < rule.variables.size(); i++) {
+                if (rule.variables[i] == variable) {
+                    if (!bound[i]) {
+                        throw std::logic_error("variable " + std::string(variable) + " of rule " + rule.name +
+                                               " is not bound to a tree");
+                    }
+                    return *bound[i];
+                }
+            }
+            throw std::invalid_argument("rule " + rule.name + " has no variable " + std::string(variable));
+        }
+
+        // value bound to a variable that only matches numbers
+        jit_float64 number(std::string_view variable) const
+        {
+            return static_cast<const NumberExprAST&>((*this)[variable]).value;
+        }
+};
+
+class RewriteRules {
+    std::vector<RewriteRule> rules;
+
+    static bool is_constant_variable(const std::string &name)
+    {
+        return name[0] == 'c' && name.find_first_not_of("0123456789", 1) == std::string::npos;
+    }
+
+    public:
+        // Throws ParseError for a malformed pattern or replacement, std::invalid_argument if the
+        // replacement uses a variable the pattern does not bind
+        RewriteRules &add(std::string name, std::string_view pattern, std::string_view replacement, bool exact,
+                          RewriteRule::Guard guard = nullptr)
+        {
+            SymbolTable variables;
+            RewriteRule rule;
+            rule.name = std::move(name);
+            rule.pattern = parse_flat(pattern, variables);
+            size_t bound = variables.size();
+            rule.replacement = parse_flat(replacement, variables);
+            if (variables.size() != bound) {
+                throw std::invalid_argument("replacement of rule " + rule.name + " uses unbound variable " +
+                                            variables.name(bound));
+            }
+            for (uint32_t slot = 0; slot < variables.size(); slot++) {
+                rule.variables.push_back(variables.name(slot));
+                rule.constant_only.push_back(is_constant_variable(variables.name(slot)));
+            }
+            rule.exact = exact;
+            rule.guard = std::move(guard);
+            rules.push_back(std::move(rule));
+            return *this;
+        }
+
+        size_t size() const { return rules.size(); }
+        const RewriteRule &operator[](size_t index) const { return rules[index]; }
+};
+
+// Identities, division by a constant and exp/log merging. Rules marked exact keep every result
+// bit-identical (x+0 is not among them, -0+0 is +0); the others are only valid with fast-math
+// semantics, they may change rounding, signed zeros, or NaN and infinity results.
+inline RewriteRules standard_rules()
+{
+    // 1/c is exact, and so is multiplying by it, when c is a power of two with a normal reciprocal
+    auto reciprocal_is_exact = [](const RewriteMatch &match) {
+        int exponent;
+        jit_float64 c = match.number("c");
+        return std::frexp(c, &exponent) == 0.5 && std::isnormal(1 / c);
+    };
+
+    RewriteRules rules;
+    rules.add("mult-one", "x*1", "x", true)
+         .add("one-mult", "1*x", "x", true)
+         .add("div-one", "x/1", "x", true)
+         .add("minus-zero", "x-0", "x", true)
+         .add("plus-negative-zero", "x+-0", "x", true)
+         .add("negative-zero-plus", "-0+x", "x", true)
+         .add("div-power-of-two", "x/c", "x*(1/c)", true, reciprocal_is_exact)
+         .add("plus-zero", "x+0", "x", false)
+         .add("zero-plus", "0+x", "x", false)
+         .add("mult-zero", "x*0", "0", false)
+         .add("zero-mult", "0*x", "0", false)
+         .add("minus-self", "x-x", "0", false)
+         .add("div-self", "x/x", "1", false)
+         .add("div-constant", "x/c", "x*(1/c)", false)
+         .add("exp-mult", "exp(a)*exp(b)", "exp(a+b)", false)
+         .add("exp-div", "exp(a)/exp(b)", "exp(a-b)", false)
+         .add("sqrt-square", "sqrt(x)*sqrt(x)", "x", false)
+         .add("log10-plus", "log10(a)+log10(b)", "log10(a*b)", false)
+         .add("log10-minus", "log10(a)-log10(b)", "log10(a/b)", false);
+    return rules;
+}
+
+enum class RewriteMode {
+    // only rules that keep results bit-identical
+    BitExact,
+    // every rule
+    FastMath,
+};
+
+// Applies rewrite rules bottom-up: the children of a node are rewritten first, then the rules are
+// tried on the node in order. When a rule fires, the rules are tried again on the operator nodes
+// its replacement creates, innermost first, while the subtrees it copies from the match are
+// already rewritten and left alone. Counts how often each rule fired and how many nodes that
+// removed from the tree. Runs in time linear in the tree size plus the size of the replacements.
+class Rewriter: public Visitor {
+    public:
+        struct RuleStats {
+            std::string rule;
+            size_t applied = 0;
+            // negative if the rule made the tree larger
+            long nodes_removed = 0;
+        };
+
+    private:
+        // bound on nested re-rewrites, so a rule set that cycles still terminates
+        static constexpr int max_depth = 32;
+
+        const RewriteRules &rules;
+        const RewriteMode mode;
+        std::vector<RuleStats> rule_stats;
+        ExprPtr current_result;
+        // node count of current_result
+        size_t current_size = 0;
+        // sum of nodes_removed over all rules
+        long removed = 0;
+        int depth = 0;
+
+        static bool match(const RewriteRule &rule, uint32_t index, const ExprAST &node,
+                          std::vector<const ExprAST*> &bound)
+        {
+            const FlatNode &pattern = rule.pattern.nodes[index];
+            switch(pattern.kind) {
+                case FlatNode::Kind::Number: {
+                    auto number = dynamic_cast<const NumberExprAST*>(&node);
+                    return number && std::memcmp(&number->value, &pattern.value, sizeof(pattern.value)) == 0;
+                }
+                case FlatNode::Kind::Identifier:
+                    if (rule.constant_only[pattern.slot] && !dynamic_cast<const NumberExprAST*>(&node)) {
+                        return false;
+                    }
+                    if (bound[pattern.slot]) {
+                        return ExprEquals().equals(*bound[pattern.slot], node);
+                    }
+                    bound[pattern.slot] = &node;
+                    return true;
+                case FlatNode::Kind::Unary: {
+                    auto unary = dynamic_cast<const UnaryExprAST*>(&node);
+                    return unary && unary->op == pattern.unary_op() && match(rule, pattern.lhs, *unary->arg, bound);
+                }
+                case FlatNode::Kind::Binary: {
+                    auto binary = dynamic_cast<const BinaryExprAST*>(&node);
+                    return binary && binary->op == pattern.binary_op() &&
+                        match(rule, pattern.lhs, *binary->lhs, bound) && match(rule, pattern.rhs, *binary->rhs, bound);
+                }
+            }
+            return false;
+        }
+
+        // Builds the replacement below index, size receives its node count. New operator nodes go
+        // through apply_rules() as soon as their operands are final.
+        ExprPtr instantiate(const RewriteRule &rule, uint32_t index, const std::vector<const ExprAST*> &bound,
+                            size_t &size)
+        {
+            const FlatNode &node = rule.replacement.nodes[index];
+            switch(node.kind) {
+                case FlatNode::Kind::Number:
+                    size = 1;
+                    return std::make_unique<NumberExprAST>(node.value);
+                case FlatNode::Kind::Identifier: {
+                    ExprCloner cloner;
+                    ExprPtr clone = cloner.clone(*bound[node.slot]);
+                    size = cloner.node_count();
+                    return clone;
+                }
+                case FlatNode::Kind::Unary: {
+                    auto arg = instantiate(rule, node.lhs, bound, size);
+                    if (auto number = dynamic_cast<const NumberExprAST*>(arg.get())) {
+                        size = 1;
+                        return std::make_unique<NumberExprAST>(evaluate(node.unary_op(), number->value));
+                    }
+                    size += 1;
+                    return reapply_rules(std::make_unique<UnaryExprAST>(node.unary_op(), std::move(arg)), size);
+                }
+                case FlatNode::Kind::Binary: {
+                    size_t lhs_size, rhs_size;
+                    auto lhs = instantiate(rule, node.lhs, bound, lhs_size);
+                    auto rhs = instantiate(rule, node.rhs, bound, rhs_size);
+                    auto lhs_number = dynamic_cast<const NumberExprAST*>(lhs.get());
+                    auto rhs_number = dynamic_cast<const NumberExprAST*>(rhs.get());
+                    if (lhs_number && rhs_number) {
+                        size = 1;
+                        return std::make_unique<NumberExprAST>(evaluate(node.binary_op(), lhs_number->value, rhs_number->value));
+                    }
+                    size = 1 + lhs_size + rhs_size;
+                    return reapply_rules(std::make_unique<BinaryExprAST>(node.binary_op(), std::move(lhs), std::move(rhs)), size);
+                }
+            }
+            return nullptr;
+        }
+
+        ExprPtr reapply_rules(ExprPtr node, size_t &size)
+        {
+            if (depth >= max_depth) {
+                return node;
+            }
+            depth++;
+            auto result = apply_rules(std::move(node), size);
+            depth--;
+            return result;
+        }
+
+        // node's children are already rewritten, size is the node count of node on entry and of
+        // the result on return
+        ExprPtr apply_rules(ExprPtr node, size_t &size)
+        {
+            for (size_t i = 0; i < rules.size(); i++) {
+                const RewriteRule &rule = rules[i];
+                if (!rule.exact && mode == RewriteMode::BitExact) {
+                    continue;
+                }
+                std::vector<const ExprAST*> bound(rule.variables.size(), nullptr);
+                if (!match(rule, rule.pattern.root, *node, bound) ||
+                    (rule.guard && !rule.guard(RewriteMatch(rule, bound)))) {
+                    continue;
+                }
+                long removed_inside = removed;
+                size_t replacement_size;
+                auto replacement = instantiate(rule, rule.replacement.root, bound, replacement_size);
+                // rules that fired inside the replacement already counted their part
+                removed_inside = removed - removed_inside;
+                long nodes_removed = static_cast<long>(size) - static_cast<long>(replacement_size) - removed_inside;
+                rule_stats[i].applied++;
+                rule_stats[i].nodes_removed += nodes_removed;
+                removed += nodes_removed;
+                size = replacement_size;
+                return replacement;
+            }
+            return node;
+        }
+
+    public:
+        Rewriter(const RewriteRules &rules, RewriteMode mode): rules{rules}, mode{mode}, rule_stats(rules.size())
+        {
+            for (size_t i = 0; i < rules.size(); i++) {
+                rule_stats[i].rule = rules[i].name;
+            }
+        }
+
+        // the rules are kept by reference and have to outlive the Rewriter
+        Rewriter(RewriteRules &&rules, RewriteMode mode) = delete;
+
+        ExprPtr rewrite(const ExprAST &ast)
+        {
+            ast.accept(this);
+            return std::move(current_result);
+        }
+
+        // per rule, in rule order, summed over every rewrite() call
+        const std::vector<RuleStats> &stats() const { return rule_stats; }
+
+        void visit_binary_node(const BinaryExprAST *node) override
+        {
+            auto lhs = rewrite(*node->lhs);
+            size_t size = 1 + current_size;
+            auto rhs = rewrite(*node->rhs);
+            size += current_size;
+            current_result = apply_rules(std::make_unique<BinaryExprAST>(node->op, std::move(lhs), std::move(rhs)), size);
+            current_size = size;
+        }
+
+        void visit_unary_node(const UnaryExprAST *node) override
+        {
+            auto arg = rewrite(*node->arg);
+            size_t size = 1 + current_size;
+            current_result = apply_rules(std::make_unique<UnaryExprAST>(node->op, std::move(arg)), size);
+            current_size = size;
+        }
+
+        void visit_number_node(const NumberExprAST *node) override
+        {
+            current_result = std::make_unique<NumberExprAST>(node->value);
+            current_size = 1;
+        }
+
+        void visit_identifier_node(const IdentifierExprAST *node) override
+        {
+            current_result = std::make_unique<IdentifierExprAST>(node->slot);
+            current_size = 1;
+        }
+};
+
+inline ExprPtr simplify(const ExprAST &ast, RewriteMode mode = RewriteMode::BitExact)
+{
+    static const RewriteRules rules = standard_rules();
+    return Rewriter(rules, mode).rewrite(ast);
+}
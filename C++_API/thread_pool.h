@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Thread pool with one task deque per worker. A worker pushes and pops its own work at the back
+// (newest first, still warm in its cache) and, when it runs dry, steals the oldest task from the
+// front of another worker's deque. Tasks submitted from outside the pool are spread round-robin.
+class WorkStealingPool {
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> next_queue{0};
+    std::atomic<bool> stopping{false};
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+
+    // index of the calling thread's queue if it is a worker of this pool, -1 otherwise
+    int worker_index() const
+    {
+        return current_pool() == this ? current_index() : -1;
+    }
+
+    static const WorkStealingPool *&current_pool()
+    {
+        static thread_local const WorkStealingPool *pool = nullptr;
+        return pool;
+    }
+
+    static int &current_index()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    bool pop(size_t queue_index, bool newest, std::function<void()> &task)
+    {
+        Queue &queue = *queues[queue_index];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        if (newest) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        pending--;
+        return true;
+    }
+
+    void worker_loop(int index)
+    {
+        current_pool() = this;
+        current_index() = index;
+        while (!stopping) {
+            if (run_one()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_lock);
+            wake.wait(lock, [this] { return stopping || pending > 0; });
+        }
+    }
+
+    public:
+        explicit WorkStealingPool(unsigned threads = std::thread::hardware_concurrency())
+        {
+            threads = std::max(threads, 1u);
+            for (unsigned i = 0; i < threads; i++) {
+                queues.push_back(std::make_unique<Queue>());
+            }
+            for (unsigned i = 0; i < threads; i++) {
+                workers.emplace_back(&WorkStealingPool::worker_loop, this, i);
+            }
+        }
+
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool &operator=(const WorkStealingPool&) = delete;
+
+        // Workers finish the task they are running, queued tasks are dropped
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &worker: workers) {
+                worker.join();
+            }
+        }
+
+        unsigned size() const { return workers.size(); }
+
+        void submit(std::function<void()> task)
+        {
+            int index = worker_index();
+            size_t queue_index = index >= 0 ? index : next_queue++ % queues.size();
+            {
+                std::lock_guard<std::mutex> guard(queues[queue_index]->lock);
+                queues[queue_index]->tasks.push_back(std::move(task));
+            }
+            pending++;
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+            }
+            wake.notify_one();
+        }
+
+        // Runs one queued task on the calling thread: the caller's own newest task if it is a
+        // worker, otherwise the oldest task of any queue. Returns false if there was nothing to do.
+        bool run_one()
+        {
+            std::function<void()> task;
+            int index = worker_index();
+            if (index >= 0 && pop(index, true, task)) {
+                task();
+                return true;
+            }
+            size_t start = index >= 0 ? index + 1 : next_queue.load();
+            for (size_t i = 0; i < queues.size(); i++) {
+                if (pop((start + i) % queues.size(), false, task)) {
+                    task();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Calls fn(chunk_begin, chunk_end) for consecutive chunks of at most `grain` elements of
+        // [begin, end) and returns once all of them ran. The calling thread runs tasks while it
+        // waits, so parallel_for can also be used from inside a pool task. If fn throws, chunks
+        // that have not started yet are skipped and the first exception is rethrown here.
+        template <typename F>
+        void parallel_for(size_t begin, size_t end, size_t grain, F fn)
+        {
+            if (begin >= end) {
+                return;
+            }
+            grain = std::max<size_t>(grain, 1);
+            std::atomic<size_t> remaining{(end - begin + grain - 1) / grain};
+            std::atomic<bool> failed{false};
+            std::exception_ptr first_error;
+            std::mutex error_lock;
+            for (size_t chunk = begin; chunk < end; chunk += grain) {
+                size_t chunk_end = std::min(chunk + grain, end);
+                submit([&, chunk, chunk_end] {
+                    if (!failed) {
+                        try {
+                            fn(chunk, chunk_end);
+                        } catch (...) {
+                            std::lock_guard<std::mutex> guard(error_lock);
+                            if (!first_error) {
+                                first_error = std::current_exception();
+                            }
+                            failed = true;
+                        }
+                    }
+                    remaining--;
+                });
+            }
+            while (remaining > 0) {
+                if (!run_one()) {
+                    std::this_thread::yield();
+                }
+            }
+            if (first_error) {
+                std::rethrow_exception(first_error);
+            }
+        }
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "ast.h"
+#include "flat.h"
+#include "dag.h"
+#include "bytecode.h"
+#include "user_function.h"
+#include "context_pool.h"
+#include "thread_pool.h"
+
+class TieredExecutor;
+
+// Formula that starts out in the bytecode interpreter and switches to native code once it is
+// called often enough. The call that reaches the executor's threshold queues a background
+// compile, every call keeps interpreting until the compiled entry point is published, and from
+// then on calls go straight to the native code. If the compile throws, the function stays in the
+// interpreter. Callable from any number of threads.
+class TieredFunction {
+    TieredExecutor &executor;
+    // constant-folded DAG, compiled on tier-up
+    const FlatExpr program;
+    const Bytecode bytecode;
+    const size_t arity;
+    std::atomic<size_t> calls{0};
+    std::atomic<bool> compiling{false};
+    std::atomic<PackedUserFunction::native_t> native{nullptr};
+    std::unique_ptr<PackedUserFunction> function;
+
+    void compile();
+
+    public:
+        TieredFunction(TieredExecutor &executor, const FlatExpr &flat, size_t arity):
+            executor{executor}, program{build_dag(fold_constants(flat))}, bytecode(program), arity{arity} {}
+
+        TieredFunction(const TieredFunction&) = delete;
+        TieredFunction &operator=(const TieredFunction&) = delete;
+
+        // Waits for a compile that is still queued or running, it refers to this function
+        ~TieredFunction();
+
+        // arguments[i] is the value of the identifier in slot i
+        jit_float64 operator()(const jit_float64 *arguments);
+
+        jit_float64 operator()(const std::vector<jit_float64> &arguments)
+        {
+            assert(arguments.size() == arity);
+            return (*this)(arguments.data());
+        }
+
+        bool is_native() const { return native.load(std::memory_order_acquire) != nullptr; }
+
+        // calls answered by the interpreter
+        size_t interpreted_calls() const { return calls.load(std::memory_order_relaxed); }
+};
+
+// Creates TieredFunctions and compiles the hot ones on a WorkStealingPool, each worker into its
+// own jit_context. Functions must be destroyed before their executor.
+class TieredExecutor {
+    WorkStealingPool &pool;
+    ContextPool contexts;
+    const size_t threshold;
+    std::atomic<size_t> compiled{0};
+
+    friend class TieredFunction;
+
+    public:
+        explicit TieredExecutor(WorkStealingPool &pool, size_t threshold = 64):
+            pool{pool}, threshold{std::max<size_t>(threshold, 1)} {}
+
+        TieredExecutor(const TieredExecutor&) = delete;
+        TieredExecutor &operator=(const TieredExecutor&) = delete;
+
+        std::unique_ptr<TieredFunction> make(const FlatExpr &flat, size_t arity)
+        {
+            return std::make_unique<TieredFunction>(*this, flat, arity);
+        }
+
+        std::unique_ptr<TieredFunction> make(const ExprAST &ast, const SymbolTable &symbols)
+        {
+            return make(flatten(ast), symbols.size());
+        }
+
+        // number of functions that were switched to native code
+        size_t compiled_count() const { return compiled; }
+};
+
+inline TieredFunction::~TieredFunction()
+{
+    while (compiling) {
+        if (!executor.pool.run_one()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+inline jit_float64 TieredFunction::operator()(const jit_float64 *arguments)
+{
+    if (auto code = native.load(std::memory_order_acquire)) {
+        return code(arguments);
+    }
+    // exactly one call sees the counter hit the threshold
+    if (calls.fetch_add(1, std::memory_order_relaxed) + 1 == executor.threshold) {
+        compile();
+    }
+    return bytecode(arguments);
+}
+
+inline void TieredFunction::compile()
+{
+    compiling = true;
+    executor.pool.submit([this] {
+        try {
+            function = executor.contexts.compile<PackedUserFunction>(program, arity);
+            // the release store makes the finished code visible to callers that load the pointer
+            native.store(function->native(), std::memory_order_release);
+            executor.compiled++;
+        } catch (...) {
+            // a failed compile is not retried, calls keep going to the interpreter
+        }
+        compiling = false;
+    });
+}
@@ -0,0 +1,565 @@
+#pragma once
+
+#include <memory>
+#include <cstdlib>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <jit/jit-plus.h>
+
+#include "ast.h"
+#include "flat.h"
+#include "power.h"
+#include "thread_pool.h"
+
+// What a function is generated from: either an expression tree or the flat form
+// (which may be a hash-consed DAG)
+struct Expression {
+    const ExprAST *ast = nullptr;
+    const FlatExpr *flat = nullptr;
+
+    Expression(const ExprAST &ast): ast{&ast} {}
+    Expression(const FlatExpr &flat): flat{&flat} {}
+};
+
+// ExpressionFunction emits the instructions for the expression into the jit_function it is part of.
+// Trees are flattened first, so both kinds of expression are emitted from the post-order array in
+// register_order(). Concrete functions decide where identifier values come from by implementing
+// load_identifier(), which is called once per identifier that the expression actually uses.
+class ExpressionFunction: public jit_function {
+    protected:
+        const Expression expression;
+        // number of identifier slots, the generated code does not depend on their names
+        const size_t arity;
+        std::vector<jit_value> identifier_values;
+
+        ExpressionFunction(jit_context &context, Expression expression, size_t arity):
+            jit_function(context), expression{expression}, arity{arity} {}
+
+        virtual jit_value load_identifier(size_t index) = 0;
+
+        // Register need of a node, labelled the Sethi-Ullman way: a leaf needs one register, a
+        // unary operator as many as its argument, a binary operator with two children of equal
+        // need one more than them, otherwise the larger need
+        static uint32_t register_need(uint32_t lhs, uint32_t rhs)
+        {
+            return lhs == rhs ? lhs + 1 : std::max(lhs, rhs);
+        }
+
+        // Order in which emit_flat() emits the nodes: every binary node gets the child that needs
+        // more registers first, so the other child's value is not held in a register, or spilled,
+        // while it is computed. Empty if the array order already does that, which is the common
+        // case for parser output, then the order costs one pass over the nodes.
+        static std::vector<uint32_t> register_order(const FlatExpr &flat)
+        {
+            // children come before their users, so one pass labels every node
+            std::vector<uint32_t> needs(flat.nodes.size(), 1);
+            bool reorder = false;
+            for (size_t i = 0; i < flat.nodes.size(); i++) {
+                const FlatNode &node = flat.nodes[i];
+                if (node.kind == FlatNode::Kind::Unary) {
+                    needs[i] = needs[node.lhs];
+                } else if (node.kind == FlatNode::Kind::Binary) {
+                    needs[i] = register_need(needs[node.lhs], needs[node.rhs]);
+                    reorder |= needs[node.rhs] > needs[node.lhs];
+                }
+            }
+            std::vector<uint32_t> order;
+            if (!reorder) {
+                return order;
+            }
+
+            // post-order walk from the root, nodes shared in a DAG are emitted once
+            order.reserve(flat.nodes.size());
+            std::vector<bool> emitted(flat.nodes.size());
+            std::vector<uint32_t> pending{flat.root};
+            while (!pending.empty()) {
+                uint32_t i = pending.back();
+                const FlatNode &node = flat.nodes[i];
+                if (emitted[i]) {
+                    pending.pop_back();
+                    continue;
+                }
+                if (node.kind == FlatNode::Kind::Unary && !emitted[node.lhs]) {
+                    pending.push_back(node.lhs);
+                    continue;
+                }
+                if (node.kind == FlatNode::Kind::Binary && (!emitted[node.lhs] || !emitted[node.rhs])) {
+                    // the child pushed last is emitted first
+                    bool rhs_first = needs[node.rhs] > needs[node.lhs];
+                    pending.push_back(rhs_first ? node.lhs : node.rhs);
+                    pending.push_back(rhs_first ? node.rhs : node.lhs);
+                    continue;
+                }
+                emitted[i] = true;
+                order.push_back(i);
+                pending.pop_back();
+            }
+            return order;
+        }
+
+        jit_value emit_expression()
+        {
+            identifier_values.assign(arity, jit_value());
+            if (expression.flat) {
+                return emit_flat(*expression.flat);
+            }
+            return emit_flat(flatten(*expression.ast));
+        }
+
+        // Pass over the post-order array in register_order(). Every node is emitted once, so
+        // nodes shared in a DAG reuse the jit_value of their first emission.
+        jit_value emit_flat(const FlatExpr &flat)
+        {
+            if (flat.nodes.empty()) {
+                return new_constant(0.0, jit_type_float64);
+            }
+            std::vector<uint32_t> order;
+            if (order_by_register_need) {
+                order = register_order(flat);
+            }
+            size_t count = order.empty() ? flat.nodes.size() : order.size();
+            std::vector<jit_value> values(flat.nodes.size());
+            for (size_t k = 0; k < count; k++) {
+                uint32_t i = order.empty() ? k : order[k];
+                const FlatNode &node = flat.nodes[i];
+                switch(node.kind) {
+                    case FlatNode::Kind::Number:
+                        values[i] = new_constant(node.value, jit_type_float64);
+                        break;
+                    case FlatNode::Kind::Identifier:
+                        values[i] = identifier_value(node.slot);
+                        break;
+                    case FlatNode::Kind::Unary:
+                        values[i] = emit_unary(node.unary_op(), values[node.lhs]);
+                        break;
+                    case FlatNode::Kind::Binary:
+                        if (node.binary_op() == BinaryOperator::Pow && flat.nodes[node.rhs].kind == FlatNode::Kind::Number) {
+                            values[i] = emit_power(values[node.lhs], flat.nodes[node.rhs].value);
+                        } else {
+                            values[i] = emit_binary(node.binary_op(), values[node.lhs], values[node.rhs]);
+                        }
+                        break;
+                }
+            }
+            return values[flat.root];
+        }
+
+        jit_value identifier_value(uint32_t slot)
+        {
+            assert(slot < identifier_values.size());
+            jit_value &value = identifier_values[slot];
+            if (!value.is_valid()) {
+                value = load_identifier(slot);
+            }
+            return value;
+        }
+
+        jit_value emit_binary(BinaryOperator op, const jit_value &lhs, const jit_value &rhs)
+        {
+            switch(op) {
+                case BinaryOperator::Plus:
+                    return insn_add(lhs, rhs);
+                case BinaryOperator::Mult:
+                    return insn_mul(lhs, rhs);
+                case BinaryOperator::Minus:
+                    return insn_sub(lhs, rhs);
+                case BinaryOperator::Div:
+                    return insn_div(lhs, rhs);
+                case BinaryOperator::Pow:
+                    // the exponent is only known at run time, power() picks the expansion there
+                    return emit_call("power", power, lhs, rhs);
+            }
+            return jit_value();
+        }
+
+        // base^exponent for a constant exponent: multiplications and roots as planned by
+        // plan_power(), a call of std::pow through power() if there is no plan
+        jit_value emit_power(const jit_value &base, jit_float64 exponent)
+        {
+            struct JitOps {
+                ExpressionFunction &function;
+
+                jit_value mult(const jit_value &a, const jit_value &b) { return function.insn_mul(a, b); }
+                jit_value div(const jit_value &a, const jit_value &b) { return function.insn_div(a, b); }
+                jit_value sqrt(const jit_value &a) { return function.insn_sqrt(a); }
+                jit_value cbrt(const jit_value &a)
+                {
+                    return function.emit_call("cbrt", [](jit_float64 x) { return std::cbrt(x); }, a);
+                }
+                jit_value one() { return function.new_constant(1.0, jit_type_float64); }
+            };
+
+            PowerPlan plan;
+            if (!plan_power(exponent, plan)) {
+                return emit_binary(BinaryOperator::Pow, base, new_constant(exponent, jit_type_float64));
+            }
+            JitOps ops{*this};
+            return expand_power(ops, base, plan);
+        }
+
+        // Signature of double f(double) and double f(double, double). Created once and never
+        // freed, the calls of every function refer to them.
+        static jit_type_t float64_signature(unsigned int params)
+        {
+            static jit_type_t float64_params[] = {jit_type_float64, jit_type_float64};
+            static const jit_type_t signatures[] = {
+                jit_type_create_signature(jit_abi_cdecl, jit_type_float64, float64_params, 1, 1),
+                jit_type_create_signature(jit_abi_cdecl, jit_type_float64, float64_params, 2, 1),
+            };
+            return signatures[params - 1];
+        }
+
+        jit_value emit_call(const char *name, jit_float64 (*native)(jit_float64), const jit_value &arg)
+        {
+            jit_value_t args[] = {arg.raw()};
+            return insn_call_native(name, reinterpret_cast<void*>(native), float64_signature(1), args, 1, JIT_CALL_NOTHROW);
+        }
+
+        jit_value emit_call(const char *name, jit_float64 (*native)(jit_float64, jit_float64), const jit_value &lhs,
+                            const jit_value &rhs)
+        {
+            jit_value_t args[] = {lhs.raw(), rhs.raw()};
+            return insn_call_native(name, reinterpret_cast<void*>(native), float64_signature(2), args, 2, JIT_CALL_NOTHROW);
+        }
+
+        jit_value emit_unary(UnaryOperator op, const jit_value &arg)
+        {
+            switch(op) {
+                case UnaryOperator::Acos:
+                    return insn_acos(arg);
+                case UnaryOperator::Asin:
+                    return insn_asin(arg);
+                case UnaryOperator::Atan:
+                    return insn_atan(arg);
+                case UnaryOperator::Cos:
+                    return insn_cos(arg);
+                case UnaryOperator::Cosh:
+                    return insn_cosh(arg);
+                case UnaryOperator::Exp:
+                    return insn_exp(arg);
+                case UnaryOperator::Log10:
+                    return insn_log10(arg);
+                case UnaryOperator::Sin:
+                    return insn_sin(arg);
+                case UnaryOperator::Sinh:
+                    return insn_sinh(arg);
+                case UnaryOperator::Sqrt:
+                    return insn_sqrt(arg);
+                case UnaryOperator::Tan:
+                    return insn_tan(arg);
+                case UnaryOperator::Tanh:
+                    return insn_tanh(arg);
+            }
+            return jit_value();
+        }
+
+        // Holds the context's build lock, and releases it again when build() throws. The
+        // instructions emitted up to the throw stay with the function, it has to be discarded.
+        struct BuildLock {
+            ExpressionFunction &function;
+
+            explicit BuildLock(ExpressionFunction &function): function{function} { function.build_start(); }
+            ~BuildLock() { function.build_end(); }
+        };
+
+        // optimisation level of the last compile_now() or recompile(), -1 before the first
+        int compiled_level = -1;
+        bool order_by_register_need = true;
+
+    public:
+        // On by default. Off emits the nodes in array order, every lhs before its rhs, which
+        // only makes sense for comparing the two, see bench_registers.cpp. Set before building.
+        void set_register_order(bool enabled) { order_by_register_need = enabled; }
+
+        // Builds and compiles right away instead of waiting for the first call to go through
+        // libjit's on-demand compiler. Several threads may call it, only the first compiles.
+        virtual void compile_now()
+        {
+            if (is_compiled()) {
+                return;
+            }
+            BuildLock lock(*this);
+            // another thread, or the on-demand compiler, may have compiled it meanwhile
+            if (is_compiled()) {
+                return;
+            }
+            build();
+            compile();
+            compiled_level = optimization_level();
+        }
+
+        // Builds and compiles again at the given optimisation level. The function has to be
+        // recompilable (set_recompilable() before its first compile): calls then go through
+        // libjit's redirector, which switches to the new code once it is compiled, and callers
+        // already running the old code finish in it, it stays until the context is destroyed.
+        // Concurrent calls for the same level compile once.
+        virtual void recompile(unsigned int level)
+        {
+            assert(is_recompilable());
+            BuildLock lock(*this);
+            if (compiled_level == static_cast<int>(level)) {
+                return;
+            }
+            set_optimization_level(level);
+            build();
+            compile();
+            compiled_level = level;
+        }
+};
+
+// Batch kernel: void kernel(const double *const *cols, double *out, size_t begin, size_t end)
+// cols holds one column per identifier (struct of arrays), the loop evaluates rows [begin, end)
+// into out[begin, end), so chunks of one batch can share the column pointers
+class BatchFunction: public ExpressionFunction {
+    std::vector<jit_value> columns;
+    jit_value row;
+
+    protected:
+        jit_value load_identifier(size_t index) override
+        {
+            return insn_load_elem(columns[index], row, jit_type_float64);
+        }
+
+    public:
+        BatchFunction(jit_context &context, Expression expression, size_t arity):
+            ExpressionFunction(context, expression, arity)
+        {
+            create();
+        }
+
+        jit_type_t create_signature() override
+        {
+            jit_type_t params[] = {jit_type_void_ptr, jit_type_void_ptr, jit_type_nuint, jit_type_nuint};
+            return jit_type_create_signature(jit_abi_cdecl, jit_type_void, params, 4, 1);
+        }
+
+        void build() override
+        {
+            jit_value cols = get_param(0);
+            jit_value out = get_param(1);
+            jit_value begin = get_param(2);
+            jit_value end = get_param(3);
+
+            // column base pointers are loop invariant, load them once
+            columns.resize(arity);
+            for (size_t i = 0; i < columns.size(); i++) {
+                columns[i] = insn_load_relative(cols, i * sizeof(void*), jit_type_void_ptr);
+            }
+
+            row = new_value(jit_type_nuint);
+            store(row, begin);
+
+            jit_label loop_start = new_label();
+            jit_label loop_end = new_label();
+            insn_label(loop_start);
+            insn_branch_if_not(insn_lt(row, end), loop_end);
+            insn_store_elem(out, row, emit_expression());
+
+            store(row, insn_add(row, new_constant(jit_nuint{1}, jit_type_nuint)));
+            insn_branch(loop_start);
+            insn_label(loop_end);
+            insn_return();
+        }
+
+        void run(const double *const *cols, double *out, size_t begin, size_t end)
+        {
+            using kernel_t = void (*)(const double *const *, double *, jit_nuint, jit_nuint);
+            reinterpret_cast<kernel_t>(closure())(cols, out, begin, end);
+        }
+};
+
+// native_signature<N>::type is jit_float64 (*)(jit_float64, ... N times)
+template <size_t N, typename... Args>
+struct native_signature: native_signature<N - 1, jit_float64, Args...> {};
+
+template <typename... Args>
+struct native_signature<0, Args...> {
+    using type = jit_float64 (*)(Args...);
+};
+
+class UserFunction: public ExpressionFunction {
+    jit_context &batch_context;
+    // the batch kernel is a second jit_function, only created for callers that batch
+    std::unique_ptr<BatchFunction> batch;
+    std::once_flag batch_created;
+    // eval_batch_parallel() compiles the kernel up front once, later calls skip the build lock
+    std::once_flag batch_compiled;
+
+    BatchFunction &batch_kernel()
+    {
+        std::call_once(batch_created, [this] {
+            batch = std::make_unique<BatchFunction>(batch_context, expression, arity);
+        });
+        return *batch;
+    }
+
+    protected:
+        jit_value load_identifier(size_t index) override
+        {
+            return get_param(index);
+        }
+
+    public:
+        UserFunction(jit_context &context, Expression expression, size_t arity):
+            ExpressionFunction(context, expression, arity), batch_context{context}
+        {
+            create();
+        }
+
+        UserFunction(jit_context &context, Expression expression, const SymbolTable &symbols):
+            UserFunction(context, expression, symbols.size()) {}
+
+        jit_type_t create_signature() override
+        {
+            std::vector<jit_type_t> params(arity, jit_type_float64);
+            return jit_type_create_signature(jit_abi_cdecl, jit_type_float64, params.data(), params.size(), 1);
+        }
+
+        void build() override
+        {
+            insn_return(emit_expression());
+        }
+
+        jit_float64 call(std::vector<jit_float64> arguments)
+        {
+            jit_float64 result;
+            std::vector<void*> _args(arguments.size());
+            std::transform(arguments.begin(), arguments.end(), _args.begin(), [](auto &i) { return &i; });
+
+            apply(_args.data(), &result);
+
+            return result;
+        }
+
+        // Typed entry point, f.compiled<2>()(x, y) is a plain indirect call. The closure goes
+        // through libjit's redirector so the first call still triggers on-demand compilation.
+        // Throws std::invalid_argument if N is not the function's arity.
+        template <size_t N>
+        typename native_signature<N>::type compiled()
+        {
+            if (N != arity) {
+                throw std::invalid_argument("compiled<" + std::to_string(N) + ">() called on a function of arity " +
+                                            std::to_string(arity));
+            }
+            return reinterpret_cast<typename native_signature<N>::type>(closure());
+        }
+
+        // Evaluate n rows at once, cols[i] points to the n values of the identifier in slot i.
+        // compile_now() only compiles the scalar function, the batch kernel is created on the
+        // first call and compiled by libjit's on-demand compiler when it is first run.
+        void eval_batch(const double *const *cols, double *out, size_t n)
+        {
+            batch_kernel().run(cols, out, 0, n);
+        }
+
+        // eval_batch split into chunks that keep the inputs and outputs of one chunk within
+        // chunk_bytes, the chunks run on the pool's workers. The compiled kernel is read-only,
+        // so every worker calls the same code without synchronisation.
+        void eval_batch_parallel(WorkStealingPool &pool, const double *const *cols, double *out, size_t n,
+                                 size_t chunk_bytes = 256 * 1024)
+        {
+            // compile up front instead of letting the first workers race into the on-demand compiler
+            BatchFunction &kernel = batch_kernel();
+            std::call_once(batch_compiled, [&kernel] { kernel.compile_now(); });
+            size_t rows = std::max<size_t>(chunk_bytes / ((arity + 1) * sizeof(double)), 1024);
+            pool.parallel_for(0, n, rows, [&kernel, cols, out](size_t begin, size_t end) {
+                kernel.run(cols, out, begin, end);
+            });
+        }
+};
+
+// Slot layout of the packed argument block: the identifier in slot i is stored at byte offset offsets[i].
+// The block is padded to a whole number of cache lines so blocks can be laid out back to back.
+struct ArgumentLayout {
+    static constexpr size_t alignment = 64;
+
+    std::vector<jit_nint> offsets;
+    size_t size;
+
+    explicit ArgumentLayout(size_t arity): offsets(arity)
+    {
+        for (size_t i = 0; i < offsets.size(); i++) {
+            offsets[i] = i * sizeof(jit_float64);
+        }
+        size_t bytes = std::max<size_t>(offsets.size() * sizeof(jit_float64), 1);
+        size = (bytes + alignment - 1) / alignment * alignment;
+    }
+};
+
+// Aligned storage for one packed argument block
+class ArgumentBlock {
+    const ArgumentLayout &layout;
+    std::unique_ptr<jit_float64, decltype(&std::free)> block;
+
+    public:
+        explicit ArgumentBlock(const ArgumentLayout &layout):
+            layout{layout},
+            block{static_cast<jit_float64*>(std::aligned_alloc(ArgumentLayout::alignment, layout.size)), &std::free}
+        {
+            if (!block) {
+                throw std::bad_alloc();
+            }
+        }
+
+        void set(size_t index, jit_float64 value)
+        {
+            *reinterpret_cast<jit_float64*>(reinterpret_cast<char*>(block.get()) + layout.offsets[index]) = value;
+        }
+
+        const jit_float64 *data() const { return block.get(); }
+};
+
+// Packed ABI: double f(const double *args), every identifier is loaded from a fixed offset of
+// the argument block, so calling cost does not depend on the number of identifiers
+class PackedUserFunction: public ExpressionFunction {
+    const ArgumentLayout layout;
+    jit_value block;
+
+    protected:
+        jit_value load_identifier(size_t index) override
+        {
+            return insn_load_relative(block, layout.offsets[index], jit_type_float64);
+        }
+
+    public:
+        PackedUserFunction(jit_context &context, Expression expression, size_t arity):
+            ExpressionFunction(context, expression, arity), layout(arity)
+        {
+            create();
+        }
+
+        PackedUserFunction(jit_context &context, Expression expression, const SymbolTable &symbols):
+            PackedUserFunction(context, expression, symbols.size()) {}
+
+        jit_type_t create_signature() override
+        {
+            jit_type_t params[] = {jit_type_void_ptr};
+            return jit_type_create_signature(jit_abi_cdecl, jit_type_float64, params, 1, 1);
+        }
+
+        void build() override
+        {
+            block = get_param(0);
+            insn_return(emit_expression());
+        }
+
+        const ArgumentLayout &argument_layout() const { return layout; }
+
+        jit_float64 call(const ArgumentBlock &arguments)
+        {
+            return native()(arguments.data());
+        }
+
+        // Entry point taking the arguments directly, arguments[i] is the value of slot i
+        using native_t = jit_float64 (*)(const jit_float64 *);
+        native_t native() const
+        {
+            return reinterpret_cast<native_t>(closure());
+        }
+};
@@ -4,6 +4,11 @@
 #include <string>
 #include <algorithm>
 #include <unordered_map>
+#include <deque>
+#include <string_view>
+#include <cstdint>
+#include <utility>
+#include <thread>
 
 #include <jit/jit.h>
 
@@ -36,10 +41,37 @@ struct NumberExprAST: public ExprAST {
     void accept(Visitor *visitor) const { visitor->visit_number_node(this); }
 };
 
-// AST node for identifier
+// Interns identifier names into dense slot IDs. The slot of an identifier is also its
+// position in the generated function's parameter list.
+class SymbolTable {
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> slots;
+
+    public:
+        SymbolTable() = default;
+        SymbolTable(const SymbolTable&) = delete;
+        SymbolTable &operator=(const SymbolTable&) = delete;
+
+        uint32_t intern(std::string_view identifier)
+        {
+            auto it = slots.find(identifier);
+            if (it != slots.end()) {
+                return it->second;
+            }
+            uint32_t slot = names.size();
+            // deque keeps the stored strings in place, so the views used as keys stay valid
+            slots.emplace(names.emplace_back(identifier), slot);
+            return slot;
+        }
+
+        const std::string &name(uint32_t slot) const { return names[slot]; }
+        size_t size() const { return names.size(); }
+};
+
+// AST node for identifier, already resolved to its slot in the SymbolTable
 struct IdentifierExprAST: public ExprAST {
-    const std::string identifier;
-    IdentifierExprAST(const std::string &id): identifier{id} {}
+    const uint32_t slot;
+    IdentifierExprAST(uint32_t slot): slot{slot} {}
     void accept(Visitor *visitor) const { visitor->visit_identifier_node(this); }
 };
 
@@ -87,12 +119,12 @@ struct UnaryExprAST: public ExprAST {
 //Visitor implementations for codegen and AST analysis
 class CodegenVisitor: public Visitor {
     jit_function_t function;
-    const std::unordered_map<std::string, jit_float64> identifier_map;
+    const SymbolTable &symbols;
     jit_value_t current_result;
 
     public:
-        CodegenVisitor(jit_function_t &function, const std::unordered_map<std::string, jit_float64> &identifier_map):
-            function{function}, identifier_map{identifier_map} {}
+        CodegenVisitor(jit_function_t &function, const SymbolTable &symbols):
+            function{function}, symbols{symbols} {}
 
         void compile(ExprAST const &ast) {
             ast.accept(this);
@@ -171,39 +203,86 @@ class CodegenVisitor: public Visitor {
         }
 
         void visit_identifier_node(const IdentifierExprAST *node) {
-            assert(identifier_map.find(node->identifier) != identifier_map.end());
-            int arg_index = std::distance(identifier_map.begin(), identifier_map.find(node->identifier));
-            current_result = jit_value_get_param(function, arg_index);
+            assert(node->slot < symbols.size());
+            current_result = jit_value_get_param(function, node->slot);
         }
 };
 
-// using the C version of API
-void compile_and_run(ExprAST const &ast, std::unordered_map<std::string, jit_float64> &identifier_map)
-{
-    jit_context_t context;
-    jit_type_t signature;
+// native_signature<N>::type is jit_float64 (*)(jit_float64, ... N times)
+template <size_t N, typename... Args>
+struct native_signature: native_signature<N - 1, jit_float64, Args...> {};
 
-    context = jit_context_create();
-    jit_context_build_start(context);
-    {
-        std::vector<jit_type_t> params(identifier_map.size());
-        std::fill(params.begin(), params.end(), jit_type_float64);
-        signature = jit_type_create_signature(jit_abi_cdecl, jit_type_float64, params.data(), params.size(), 1);
-        jit_function_t function = jit_function_create(context, signature);
-        jit_type_free(signature);
+template <typename... Args>
+struct native_signature<0, Args...> {
+    using type = jit_float64 (*)(Args...);
+};
 
-        CodegenVisitor cv(function, identifier_map);
-        cv.compile(ast);
-        jit_function_compile(function);
+template <size_t... I>
+jit_float64 call_native(void *closure, const std::vector<jit_float64> &args, std::index_sequence<I...>)
+{
+    using function_t = typename native_signature<sizeof...(I)>::type;
+    return reinterpret_cast<function_t>(closure)(args[I]...);
+}
 
+// Calls the closure with a typed function pointer for arities up to MaxArity,
+// larger signatures fall back to the generic jit_function_apply marshalling
+template <size_t MaxArity = 8>
+jit_float64 call_native(jit_function_t function, const std::vector<jit_float64> &args)
+{
+    if constexpr (MaxArity > 0) {
+        if (args.size() != MaxArity) {
+            return call_native<MaxArity - 1>(function, args);
+        }
+        return call_native(jit_function_to_closure(function), args, std::make_index_sequence<MaxArity>{});
+    } else if (!args.empty()) {
         jit_float64 result;
-        //Dumb API
-        std::vector<void*> args(identifier_map.size());
-        std::transform(identifier_map.begin(), identifier_map.end(), args.begin(), [](auto &p) { return &p.second; });
-        jit_function_apply(function, args.data(), &result);
-        printf("Result: %lf\n", result);
+        std::vector<void*> arg_ptrs(args.size());
+        std::transform(args.begin(), args.end(), arg_ptrs.begin(), [](auto &a) { return const_cast<jit_float64*>(&a); });
+        jit_function_apply(function, arg_ptrs.data(), &result);
+        return result;
     }
+    return reinterpret_cast<native_signature<0>::type>(jit_function_to_closure(function))();
+}
+
+// Handle to a compiled expression. Compiled code is read-only, so a handle can be evaluated from
+// any number of threads at once, also while other functions are compiled in the same context.
+struct CompiledFunction {
+    jit_function_t function;
+    size_t arity;
+};
+
+// using the C version of API
+// The context's build lock is only held while the function is generated and compiled
+CompiledFunction compile(jit_context_t context, ExprAST const &ast, const SymbolTable &symbols)
+{
+    jit_context_build_start(context);
+
+    std::vector<jit_type_t> params(symbols.size());
+    std::fill(params.begin(), params.end(), jit_type_float64);
+    jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, jit_type_float64, params.data(), params.size(), 1);
+    jit_function_t function = jit_function_create(context, signature);
+    jit_type_free(signature);
+
+    CodegenVisitor cv(function, symbols);
+    cv.compile(ast);
+    jit_function_compile(function);
+
     jit_context_build_end(context);
+    return CompiledFunction{function, symbols.size()};
+}
+
+// args[i] is the value of the identifier in slot i, runs without taking any libjit lock
+jit_float64 evaluate(const CompiledFunction &compiled, const std::vector<jit_float64> &args)
+{
+    assert(args.size() == compiled.arity);
+    return call_native(compiled.function, args);
+}
+
+void compile_and_run(ExprAST const &ast, const SymbolTable &symbols, const std::vector<jit_float64> &args)
+{
+    jit_context_t context = jit_context_create();
+    CompiledFunction function = compile(context, ast, symbols);
+    printf("Result: %lf\n", evaluate(function, args));
     jit_context_destroy(context);
 }
 
@@ -216,8 +295,8 @@ std::unique_ptr<NumberExprAST> Number(double val)
     return std::make_unique<NumberExprAST>(static_cast<jit_float64>(val));
 }
 
-std::unique_ptr<IdentifierExprAST> Identifier(std::string identifier) {
-    return std::make_unique<IdentifierExprAST>(identifier);
+std::unique_ptr<IdentifierExprAST> Identifier(SymbolTable &symbols, std::string_view identifier) {
+    return std::make_unique<IdentifierExprAST>(symbols.intern(identifier));
 }
 
 std::unique_ptr<BinaryExprAST> Mult(std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs)
@@ -232,7 +311,25 @@ std::unique_ptr<BinaryExprAST> Add(std::unique_ptr<ExprAST> lhs, std::unique_ptr
 
 int main(void)
 {
-    auto ast = Add(Mult(Number(1), Number(2)), Mult(Identifier("y"), Identifier("x")));
-    std::unordered_map<std::string, jit_float64> args = {{"x", 6}, {"y", 2}};
-    compile_and_run(*ast, args);
+    SymbolTable symbols;
+    auto ast = Add(Mult(Number(1), Number(2)), Mult(Identifier(symbols, "y"), Identifier(symbols, "x")));
+    std::vector<jit_float64> args(symbols.size());
+    args[symbols.intern("x")] = 6;
+    args[symbols.intern("y")] = 2;
+    compile_and_run(*ast, symbols, args);
+
+    // evaluation of f on a second thread does not wait for g being compiled in the same context
+    jit_context_t context = jit_context_create();
+    CompiledFunction f = compile(context, *ast, symbols);
+    jit_float64 sum = 0;
+    std::thread evaluator([&] {
+        for (int i = 0; i < 1000; i++) {
+            sum += evaluate(f, args);
+        }
+    });
+    auto g_ast = Mult(Add(Identifier(symbols, "x"), Number(1)), Identifier(symbols, "y"));
+    CompiledFunction g = compile(context, *g_ast, symbols);
+    evaluator.join();
+    printf("Concurrent results: %lf %lf\n", sum, evaluate(g, args));
+    jit_context_destroy(context);
 }